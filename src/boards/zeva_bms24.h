@@ -0,0 +1,145 @@
+/******************************************************************************
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright 2021 Joseph Kroesche
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *****************************************************************************/
+
+#ifndef __BOARD_ZEVA_BMS24_H__
+#define __BOARD_ZEVA_BMS24_H__
+
+// Board profile for the Zeva BMS-24 module (the default board).
+//
+// A board profile provides the clock frequency, the CAN bus rate, the GPIO
+// setup, the status LED and the board ID for the boot loader. To port the
+// boot loader to another board, copy this file to a new name in this
+// directory and build with BOARD=<name> (see the Makefile).
+//
+// - ATMega16M1, external 8 MHz crystal
+// - red LED on PD3, active high
+// - 16 position rotary switch for the board ID, active low, on PD5 (MSB),
+//   PD7, PB2, PD6 (LSB)
+// - trace pins for CONFIG_TRACE on the unconnected PB0 and PB1
+
+// the clock can be changed from the build, for example F_CPU=16000000UL
+#ifndef F_CPU
+#define F_CPU 8000000UL
+#endif
+
+// CAN bus rate in bits per second
+#ifndef CAN_BITRATE
+#define CAN_BITRATE 250000UL
+#endif
+
+// status LED
+#define BOARD_LED_ON()      do { PORTD |= _BV(PORTD3); } while (0)
+#define BOARD_LED_OFF()     do { PORTD &= ~_BV(PORTD3); } while (0)
+#define BOARD_LED_TOGGLE()  do { PIND = _BV(PORTD3); } while (0)
+
+// trace pins, only used by a CONFIG_TRACE build (bit numbers in PORTB)
+// PB0 has the message path: a pulse when a frame is received, high while it
+// is processed, and a pulse when the report is sent. PB1 has the flash path:
+// high during page fill, erase and write, with a short low between erase and
+// write.
+#define BOARD_TRACE_PORT    PORTB
+#define BOARD_TRACE_PIN     PINB
+#define BOARD_TRACE_DDR     DDRB
+#define BOARD_TRACE_RX      PORTB0
+#define BOARD_TRACE_MSG     PORTB0
+#define BOARD_TRACE_TX      PORTB0
+#define BOARD_TRACE_FILL    PORTB1
+#define BOARD_TRACE_ERASE   PORTB1
+#define BOARD_TRACE_WRITE   PORTB1
+
+// Port Configuration
+//
+//  | Port  |IO |PU | Usage                                 |
+//  |-------|---|---|---------------------------------------|
+//  | PB0   | I | - | NC (trace pin for CONFIG_TRACE)       |
+//  | PB1   | I | - | NC (trace pin for CONFIG_TRACE)       |
+//  | PB2   | I |PU | ID encoder position 2                 |
+//  | PB3   | O | - | LTC1 SCK (not used for bootloader)    |
+//  | PB4   | I | - | 5V (why?)                             |
+//  | PB6   | O | - | LTC2 CS                               |
+//  | PB7   | O | - | LTC2 SDI                              |
+//  | PC0   | I | - | NC                                    |
+//  | PC1   | O | - | Green LED                             |
+//  | PC2   | O | - | CAN TX                                |
+//  | PC3   | I | - | CAN RX                                |
+//  | PC4   | I | - | LTC1 SDO                              |
+//  | PC5   | O | - | LTC1 CS                               |
+//  | PC6   | O | - | LTC1 SDI                              |
+//  | PC7   | I | - | NC                                    |
+//  | PD0   | O | - | LTC2 SCK                              |
+//  | PD1   | I | - | tied to reset line (why?)             |
+//  | PD2   | O | - | prog MISO (needs configured?)         |
+//  | PD3   |I/O| - | prog MOSI / Red LED                   |
+//  | PD4   | I | - | prog SCK                              |
+//  | PD5   | I |PU | ID encoder position 8                 |
+//  | PD6   | I |PU | ID encoder position 1                 |
+//  | PD7   | I |PU | ID encoder position 4                 |
+//  | PE0   | I | - | RESET/                                |
+//  | PE1   | I | - | XTAL                                  |
+//  | PE2   | I | - | XTAL                                  |
+//
+// Notes:
+// - Battery chips LTCx are not used for boot loader
+// - Progamming pin functions are automatic so they dont need to be
+//   configured (PD2 not set to output)
+// - Even though PD3 is programming input, it is LED output so should
+//   be configured as output
+
+/** Set up the GPIO for the boot loader. */
+static inline void board_gpio_init(void)
+{
+    // set GPIO directions
+    DDRB = 0;                       // LTC outputs not enabled for boot loader
+    DDRC = _BV(DDC1) | _BV(DDC2);   // CAN TX and green LED
+    DDRD = _BV(DDD3);               // Red LED
+
+    // set pullups for ID encoder
+    PORTB = _BV(PORTB2);
+    PORTC = 0;
+    PORTD = _BV(PORTD5) | _BV(PORTD6) | _BV(PORTD7);
+}
+
+/** Read the 4-bit board ID from the rotary switch. */
+static inline uint8_t board_get_id(void)
+{
+    // Because the encoder bits are scattered among GPIOs and not in order
+    // on a port, there is not an easier way to do this other than to check
+    // every bit.
+    uint8_t id = 0;
+    if (!(PIND & _BV(PD5))) {
+        id += 8;
+    }
+    if (!(PIND & _BV(PD7))) {
+        id += 4;
+    }
+    if (!(PINB & _BV(PB2))) {
+        id += 2;
+    }
+    if (!(PIND & _BV(PD6))) {
+        id += 1;
+    }
+    return id;
+}
+
+#endif
@@ -0,0 +1,100 @@
+/******************************************************************************
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright 2021 Joseph Kroesche
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *****************************************************************************/
+
+#ifndef __CAN_BITTIMING_H__
+#define __CAN_BITTIMING_H__
+
+// Compile time CAN bit timing for the ATMegaXXM1 CAN controller.
+//
+// Computes the CANBT1-3 register values from F_CPU and CAN_BITRATE. The bit
+// is divided into a number of time quanta (TQ). The prescaler (BRP) divides
+// the clock to get the TQ. The first number of TQ per bit, from the list
+// below, that divides the clock exactly is used. If none do, 8 TQ is used
+// with the nearest prescaler, as long as the bit rate error is small enough.
+//
+// The segments are split for a sample point near 75%:
+//   bit = SYNC (1) + PRS + PHS1 + PHS2, PHS1 = PHS2 = TQ/4
+// SJW is 1 TQ. Three point sampling is used unless the prescaler is 1.
+//
+// For 8 MHz and 250 kbit/s this gives 8 TQ, BRP 4, PRS 3, PHS1 2, PHS2 2,
+// which is the setting from the data sheet table.
+
+#if !defined(F_CPU) || !defined(CAN_BITRATE)
+#error "F_CPU and CAN_BITRATE must be defined (see the board profile)"
+#endif
+
+// clocks per bit
+#define CAN_BITCLKS (F_CPU / CAN_BITRATE)
+
+#if ((CAN_BITCLKS % 8) == 0) && ((CAN_BITCLKS / 8) <= 64)
+#define CAN_TQ 8
+#elif ((CAN_BITCLKS % 16) == 0) && ((CAN_BITCLKS / 16) <= 64)
+#define CAN_TQ 16
+#elif ((CAN_BITCLKS % 10) == 0) && ((CAN_BITCLKS / 10) <= 64)
+#define CAN_TQ 10
+#elif ((CAN_BITCLKS % 12) == 0) && ((CAN_BITCLKS / 12) <= 64)
+#define CAN_TQ 12
+#else
+#define CAN_TQ 8
+#endif
+
+// prescaler, rounded to nearest
+#define CAN_BRP ((F_CPU + ((CAN_BITRATE * CAN_TQ) / 2)) / (CAN_BITRATE * CAN_TQ))
+
+#if (CAN_BRP < 1) || (CAN_BRP > 64)
+#error "CAN bit rate can not be reached with this F_CPU"
+#endif
+
+// actual bit rate, and error in units of 0.1%
+#define CAN_BITRATE_ACTUAL (F_CPU / (CAN_BRP * CAN_TQ))
+#if CAN_BITRATE_ACTUAL > CAN_BITRATE
+#define CAN_BITRATE_ERR (((CAN_BITRATE_ACTUAL - CAN_BITRATE) * 1000) / CAN_BITRATE)
+#else
+#define CAN_BITRATE_ERR (((CAN_BITRATE - CAN_BITRATE_ACTUAL) * 1000) / CAN_BITRATE)
+#endif
+
+// the CAN spec allows about 1.5% total clock tolerance between nodes,
+// so the bit rate error of this node is kept to 0.5% or less
+#if CAN_BITRATE_ERR > 5
+#error "CAN bit rate error is more than 0.5% with this F_CPU"
+#endif
+
+// segment lengths in TQ
+#define CAN_PHS2 (CAN_TQ / 4)
+#define CAN_PHS1 CAN_PHS2
+#define CAN_PRS (CAN_TQ - 1 - CAN_PHS1 - CAN_PHS2)
+#define CAN_SJW 1
+
+#if (CAN_PRS > 8) || (CAN_PHS1 > 8) || (CAN_PHS2 < 2)
+#error "CAN bit timing segments are out of range"
+#endif
+
+#define CAN_SMP ((CAN_BRP > 1) ? 1 : 0)
+
+// register values
+#define CANBT1_VAL ((CAN_BRP - 1) << 1)
+#define CANBT2_VAL (((CAN_SJW - 1) << 5) | ((CAN_PRS - 1) << 1))
+#define CANBT3_VAL (((CAN_PHS2 - 1) << 4) | ((CAN_PHS1 - 1) << 1) | CAN_SMP)
+
+#endif
@@ -0,0 +1,216 @@
+/******************************************************************************
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright 2021 Joseph Kroesche
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *****************************************************************************/
+
+#ifndef __CANBOOT_H__
+#define __CANBOOT_H__
+
+// Definitions shared between the CAN boot loader and the application.
+//
+// The application can include this header to find the things the boot
+// loader leaves for it, or expects from it. It only depends on <avr/io.h>, and
+// <avr/pgmspace.h> for `canboot_api_version()`.
+
+#include <stdint.h>
+
+/** Value the application writes to `request` to ask for the boot loader.
+ *
+ * The boot loader checks (and clears) the request word at every reset. If it
+ * holds this value, the boot loader stays resident for the activity timeout
+ * the same way it does after a watchdog reset.
+ */
+#define CANBOOT_REQUEST_MAGIC 0xB007U
+
+/** Base CAN ID of the boot loader messages.
+ *
+ * The boot loader uses 29-bit IDs. Bits 7:4 are the board ID and bits 3:0
+ * are the command (see doc/protocol.md).
+ */
+#define CANBOOT_CANID 0x1B007100UL
+
+/** Command ID of the ENTER command.
+ *
+ * A running app should reset into the boot loader when it receives this for
+ * its board ID (see canboot_app.h). The boot loader itself answers it like a
+ * PING.
+ */
+#define CANBOOT_CMD_ENTER 6
+
+/** Number of bytes at the top of RAM shared with the application. */
+#define CANBOOT_SHARED_SIZE 16
+
+/** Byte address of the shared RAM area.
+ *
+ * The boot loader stack starts below this address, so the contents survive
+ * while the boot loader runs. The application stack starts at `RAMEND` and
+ * will eventually overwrite it, so the application should look at it early.
+ */
+#define CANBOOT_SHARED_ADDR (RAMEND + 1 - CANBOOT_SHARED_SIZE)
+
+/** Layout of the RAM area shared with the application.
+ *
+ * The boot timing fields are Timer1 counts, which the boot loader starts in
+ * its C startup code right after reset, running at F_CPU/1024 (`tick_us`
+ * microseconds per count). A field is 0 if that phase did not happen during
+ * this boot, for example the boot window is skipped in zero-wait mode. The
+ * counter wraps after 65536 ticks (8.4 seconds at 8 MHz), which only happens
+ * if the boot loader stays for a long time, like during a load.
+ *
+ * The boot loader stops Timer1 and puts it back in the reset state before it
+ * starts the app.
+ */
+struct canboot_shared {
+    uint16_t request;       ///< boot request word, see CANBOOT_REQUEST_MAGIC
+    uint16_t t_init;        ///< boot loader device init done
+    uint16_t t_window;      ///< boot window closed (timeout or RUN command)
+    uint16_t t_crc;         ///< app integrity check done
+    uint16_t t_jump;        ///< jump to the app
+    uint8_t tick_us;        ///< microseconds per timer count, rounded down
+    uint8_t reset_cause;    ///< MCUSR at reset, bit 7 set for boot request
+};
+
+/** Application access to the shared RAM area. */
+#define CANBOOT_SHARED (*(volatile struct canboot_shared *)CANBOOT_SHARED_ADDR)
+
+/** Version of the CAN driver API exported by the boot loader.
+ *
+ * This is incremented when functions are added to the end of the jump table.
+ */
+#define CANBOOT_API_VERSION 2
+
+/** Flash byte address of the CAN driver API table.
+ *
+ * The table is the last 16 bytes of the boot section. The first word is the
+ * API version, followed by one jump instruction per function. If the version
+ * word reads as 0xFFFF then the boot loader was built without the API
+ * (`CONFIG_CAN_API=0`, such as the size optimized variant) and the functions
+ * must not be called.
+ */
+#define CANBOOT_API_ADDR (FLASHEND + 1 - 16)
+
+/** Start of the boot section.
+ *
+ * This assumes the 2K boot section. Define it before including this header
+ * if the boot loader was built for a different size.
+ */
+#ifndef CANBOOT_BOOT_START
+#define CANBOOT_BOOT_START (FLASHEND + 1 - 2048)
+#endif
+
+/** Start of the staging slot, for a boot loader with the dual slot build.
+ *
+ * The app flash is split in two equal slots. The app runs from the lower slot
+ * and a new image is loaded into the upper slot.
+ */
+#define CANBOOT_STAGE_ADDR ((CANBOOT_BOOT_START / 2) & ~(SPM_PAGESIZE - 1))
+
+/** EEPROM locations of the dual slot copy journal (see doc/spec.md). */
+#define CANBOOT_EEP_JRNL_STATE ((uint8_t *)(E2END - 7))
+#define CANBOOT_EEP_JRNL_PAGE ((uint8_t *)(E2END - 8))
+#define CANBOOT_EEP_JRNL_LEN ((uint16_t *)(E2END - 10))
+#define CANBOOT_EEP_JRNL_CRC ((uint16_t *)(E2END - 12))
+#define CANBOOT_EEP_JRNL_TAG ((uint16_t *)(E2END - 14))
+
+/** Default mask for the boot loader CAN ID filter.
+ *
+ * Bits that are set must match the ID base. The command bits 3:0 are not
+ * matched. The board ID bits 7:4 are always matched.
+ */
+#define CANBOOT_CANIDMASK 0x1FFFFFF0UL
+
+/** EEPROM locations of the CAN ID config (see doc/spec.md).
+ *
+ * An installation can move the boot loader messages to another CAN ID base,
+ * for example to give them a higher priority on a busy bus. The config is
+ * only used if its CRC matches. Otherwise the boot loader uses CANBOOT_CANID
+ * and CANBOOT_CANIDMASK.
+ */
+#define CANBOOT_EEP_CAN_BASE ((uint32_t *)(E2END - 24))
+#define CANBOOT_EEP_CAN_MASK ((uint32_t *)(E2END - 20))
+#define CANBOOT_EEP_CAN_CRC ((uint16_t *)(E2END - 16))
+
+/** Initial value of the CAN ID config CRC.
+ *
+ * This is not 0, so that an EEPROM of all 0 is not a valid config.
+ */
+#define CANBOOT_CANCFG_CRC_INIT 0xFFFFU
+
+/** Journal state that tells the boot loader to copy the staging slot. */
+#define CANBOOT_JRNL_COPY 0x5A
+
+/** Value returned by `can_receive()` when there is no new message. */
+#define CANBOOT_NO_MSG 0xFF
+
+/** Flag in the `can_send()` return value when the message was not sent. */
+#define CANBOOT_TX_FAIL 0x80
+
+#ifndef __ASSEMBLER__
+
+// Function entries of the API table. Function pointers on AVR are word
+// addresses, so the byte address is divided by 2.
+#define CANBOOT_API_ENTRY(n) ((CANBOOT_API_ADDR + 2 + ((n) * 2)) / 2)
+
+typedef void (*canboot_can_init_t)(void);
+typedef void (*canboot_can_rx_setup_t)(uint8_t mob, uint32_t id, uint32_t mask);
+typedef uint8_t (*canboot_can_receive_t)(uint8_t mob, uint32_t *pid, uint8_t *pbuf);
+typedef uint8_t (*canboot_can_send_t)(uint8_t mob, uint32_t id, uint8_t len, const uint8_t *pbuf);
+typedef uint8_t (*canboot_flash_write_page_t)(uint16_t addr, const uint8_t *pbuf);
+
+/** CAN driver functions in the boot loader, callable by the application.
+ *
+ * These use 29-bit CAN IDs. Each function saves and restores CANPAGE so it
+ * can be used alongside the app's own use of other MOBs. The boot loader
+ * always uses the MOB given by the caller, so the app decides which MOBs are
+ * used. `canboot_can_send()` waits for the message to go out.
+ *
+ * - `canboot_can_init()` - reset and enable the CAN controller, 250 kbit/s
+ * - `canboot_can_rx_setup(mob, id, mask)` - receive IDs matching id/mask
+ * - `canboot_can_receive(mob, &id, buf)` - returns DLC or CANBOOT_NO_MSG
+ * - `canboot_can_send(mob, id, len, buf)` - send and wait for completion,
+ *   returns the number of transmit errors, with CANBOOT_TX_FAIL set if the
+ *   message was given up after too many errors or bus-off
+ *
+ * Check `canboot_api_version()` before calling any of them.
+ */
+#define canboot_can_init ((canboot_can_init_t)CANBOOT_API_ENTRY(0))
+#define canboot_can_rx_setup ((canboot_can_rx_setup_t)CANBOOT_API_ENTRY(1))
+#define canboot_can_receive ((canboot_can_receive_t)CANBOOT_API_ENTRY(2))
+#define canboot_can_send ((canboot_can_send_t)CANBOOT_API_ENTRY(3))
+
+/** Flash page write service in the boot loader (API version 2).
+ *
+ * Only code in the boot section can write flash, so the app uses this to
+ * write a page of app flash, for example to receive a new image into the
+ * staging slot while it keeps running. `addr` must be the start of a page
+ * below the boot section, and `pbuf` has SPM_PAGESIZE bytes. It returns 0 if
+ * the page was written, or 1 if the address is not allowed. Interrupts are
+ * disabled while the page is written (a few milliseconds).
+ */
+#define canboot_flash_write_page ((canboot_flash_write_page_t)CANBOOT_API_ENTRY(4))
+
+/** Read the API version word from the boot loader (0xFFFF if no API). */
+#define canboot_api_version() pgm_read_word(CANBOOT_API_ADDR)
+
+#endif
+
+#endif
@@ -0,0 +1,93 @@
+/******************************************************************************
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright 2021 Joseph Kroesche
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *****************************************************************************/
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <avr/io.h>
+#include <avr/eeprom.h>
+#include <avr/interrupt.h>
+#include <avr/wdt.h>
+#include <util/crc16.h>
+
+#include "canboot_app.h"
+
+// CRC of the CAN ID config in EEPROM
+static uint16_t can_config_crc(void)
+{
+    const uint8_t *p = (const uint8_t *)CANBOOT_EEP_CAN_BASE;
+    uint16_t crc = CANBOOT_CANCFG_CRC_INIT;
+    for (uint8_t i = 0; i < 8; ++i) {
+        crc = _crc16_update(crc, eeprom_read_byte(p + i));
+    }
+    return crc;
+}
+
+uint32_t canboot_can_id_base(void)
+{
+    if (can_config_crc() == eeprom_read_word(CANBOOT_EEP_CAN_CRC)) {
+        return eeprom_read_dword(CANBOOT_EEP_CAN_BASE) & 0x1FFFFF00UL;
+    }
+    return CANBOOT_CANID;
+}
+
+void canboot_set_can_id(uint32_t base, uint32_t mask)
+{
+    eeprom_update_dword(CANBOOT_EEP_CAN_BASE, base);
+    eeprom_update_dword(CANBOOT_EEP_CAN_MASK, mask);
+    eeprom_update_word(CANBOOT_EEP_CAN_CRC, can_config_crc());
+    eeprom_busy_wait();
+}
+
+bool canboot_is_enter_request(uint8_t boardid, uint32_t id)
+{
+    // check the low byte first, so the EEPROM config is only read for a
+    // message that could be an ENTER
+    if ((uint8_t)id != (uint8_t)((boardid << 4) + CANBOOT_CMD_ENTER)) {
+        return false;
+    }
+    return (id & 0x1FFFFF00UL) == canboot_can_id_base();
+}
+
+void canboot_enter(void)
+{
+    cli();
+    // the boot loader sees this when it starts, and stays for the
+    // activity timeout
+    CANBOOT_SHARED.request = CANBOOT_REQUEST_MAGIC;
+    wdt_enable(WDTO_15MS);
+    for (;;)
+    {}
+}
+
+void canboot_commit(uint16_t len, uint16_t crc, uint16_t tag)
+{
+    eeprom_update_word(CANBOOT_EEP_JRNL_LEN, len);
+    eeprom_update_word(CANBOOT_EEP_JRNL_CRC, crc);
+    eeprom_update_word(CANBOOT_EEP_JRNL_TAG, tag);
+    eeprom_update_byte(CANBOOT_EEP_JRNL_PAGE, 0);
+    eeprom_update_byte(CANBOOT_EEP_JRNL_STATE, CANBOOT_JRNL_COPY);
+    eeprom_busy_wait();
+    canboot_enter();
+}
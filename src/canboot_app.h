@@ -0,0 +1,103 @@
+/******************************************************************************
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright 2021 Joseph Kroesche
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *****************************************************************************/
+
+#ifndef __CANBOOT_APP_H__
+#define __CANBOOT_APP_H__
+
+// Application companion library for the CAN boot loader.
+//
+// Add canboot_app.c to the application build. The application passes each
+// CAN message it receives to `canboot_is_enter_request()`, and if that returns
+// true it calls `canboot_enter()`, which resets into the boot loader. The
+// boot loader then waits for the long activity timeout instead of starting
+// the app again.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "canboot.h"
+
+/** CAN ID of the ENTER command for a board.
+ *
+ * The application can use this (and mask 0x1FFFFFFF) to set up a receive
+ * filter for the ENTER command. This is for the default ID base. If the
+ * installation has a CAN ID config, use `canboot_can_id_base()` instead.
+ */
+#define CANBOOT_ENTER_ID(boardid) \
+    (CANBOOT_CANID + ((uint32_t)(boardid) << 4) + CANBOOT_CMD_ENTER)
+
+/** Get the CAN ID base the boot loader uses.
+ *
+ * This is the base from the EEPROM config if it is valid, otherwise
+ * CANBOOT_CANID.
+ *
+ * @returns the 29-bit CAN ID base, with the low byte 0
+ */
+extern uint32_t canboot_can_id_base(void);
+
+/** Write the CAN ID config for the boot loader.
+ *
+ * The boot loader uses the new ID base and filter mask the next time it
+ * starts. Bits 7:0 of the base are not used. The mask has the bits that must
+ * match the base, use CANBOOT_CANIDMASK to match the whole base.
+ *
+ * @param base 29-bit CAN ID base for the boot loader messages
+ * @param mask receive filter mask
+ */
+extern void canboot_set_can_id(uint32_t base, uint32_t mask);
+
+/** Check if a received CAN message is a boot loader ENTER request.
+ *
+ * @param boardid the board ID of this board (0-15)
+ * @param id the 29-bit CAN ID of the received message
+ *
+ * @returns true if the message is an ENTER command for this board
+ */
+extern bool canboot_is_enter_request(uint8_t boardid, uint32_t id);
+
+/** Reset into the boot loader.
+ *
+ * Disables interrupts, sets the boot request word in the shared RAM area and
+ * then lets the watchdog expire with the shortest timeout. This function
+ * does not return.
+ */
+extern void canboot_enter(void) __attribute__ ((noreturn));
+
+/** Commit a new image that the app wrote to the staging slot.
+ *
+ * For a boot loader with the dual slot build. The app writes the new image
+ * starting at CANBOOT_STAGE_ADDR, using `canboot_flash_write_page()`, and then
+ * calls this. It records the image in the boot loader copy journal and resets
+ * into the boot loader, which checks the CRC and copies the image over the
+ * app. If the CRC does not match, the old app is kept. This function does not
+ * return.
+ *
+ * @param len length of the new image in bytes
+ * @param crc CRC of the new image (same CRC as the STOP command)
+ * @param tag version tag to store with the image
+ */
+extern void canboot_commit(uint16_t len, uint16_t crc, uint16_t tag)
+    __attribute__ ((noreturn));
+
+#endif
@@ -34,10 +34,106 @@
 #include <avr/wdt.h>
 #include <util/crc16.h>
 
-// search for PORTING, for notes about possible changes to port the boot loader
+#include "canboot.h"
 
-// PORTING: set the frequency to match the hardware setup
-#define F_CPU 8000000UL
+// The board specific settings (clock, CAN bus rate, GPIO, LED and board ID)
+// are in a board profile header in boards/, selected with BOARD in the
+// Makefile.
+
+// Optional features. These default to on, and can be turned off at build time
+// to make the boot loader smaller. The SMALL build in the Makefile turns them
+// off to fit in the 1K boot section.
+//
+// CONFIG_LED - blink the status LED
+// CONFIG_CANPAGE_SAVE - save and restore CANPAGE when using a MOB
+// CONFIG_BOOT_TIMING - record boot timing for the app (see canboot.h)
+// CONFIG_CAN_API - export the CAN driver and the flash page write to the app
+//   with a jump table at the end of the boot section (see canboot.h), and
+//   answer the ENTER command. This needs CONFIG_CANPAGE_SAVE
+// CONFIG_RUN - start a valid app when the host sends RUN
+// CONFIG_ANNOUNCE - send an ANNOUNCE report when the boot loader starts
+// CONFIG_PING_INFO - return the info selected by the PING payload
+// CONFIG_APP_TAG - store the version tag from STOP with the app image info
+// CONFIG_STACK_PAINT - fill unused RAM with a pattern at startup so the peak
+//   stack depth can be queried with PING
+// CONFIG_CAN_DIAG - count CAN receive overruns, transmit errors and bus-off
+//   events, recover from bus-off, and report the counters with PING
+// CONFIG_CAN_IDCFG - read the CAN ID base and filter mask from a config in
+//   EEPROM, if there is a valid one
+// CONFIG_STATS - keep session statistics in .noinit RAM, reported with the
+//   STATS command
+// CONFIG_DUAL_SLOT - receive a new image into a staging slot in the upper half
+//   of the app flash, and only copy it over the app after the CRC is checked.
+//   (defaults to on for parts with more than 16K flash, like ATMega32M1)
+// CONFIG_NO_VECTORS - provide minimal startup code instead of the C runtime
+//   startup files, so there is no interrupt vector table. This must be
+//   linked with -nostartfiles. (defaults to off)
+// CONFIG_TRACE - drive the board trace pins at points in the message and
+//   flash write path, for timing with a logic analyzer. (defaults to off)
+#ifndef CONFIG_LED
+#define CONFIG_LED 1
+#endif
+#ifndef CONFIG_CANPAGE_SAVE
+#define CONFIG_CANPAGE_SAVE 1
+#endif
+#ifndef CONFIG_BOOT_TIMING
+#define CONFIG_BOOT_TIMING 1
+#endif
+#ifndef CONFIG_CAN_API
+#define CONFIG_CAN_API 1
+#endif
+#ifndef CONFIG_RUN
+#define CONFIG_RUN 1
+#endif
+#ifndef CONFIG_ANNOUNCE
+#define CONFIG_ANNOUNCE 1
+#endif
+#ifndef CONFIG_PING_INFO
+#define CONFIG_PING_INFO 1
+#endif
+#ifndef CONFIG_APP_TAG
+#define CONFIG_APP_TAG 1
+#endif
+#ifndef CONFIG_STACK_PAINT
+#define CONFIG_STACK_PAINT 1
+#endif
+#ifndef CONFIG_CAN_DIAG
+#define CONFIG_CAN_DIAG 1
+#endif
+#ifndef CONFIG_CAN_IDCFG
+#define CONFIG_CAN_IDCFG 1
+#endif
+#ifndef CONFIG_STATS
+#define CONFIG_STATS 1
+#endif
+#ifndef CONFIG_DUAL_SLOT
+#define CONFIG_DUAL_SLOT (FLASHEND > 0x3FFF)
+#endif
+#ifndef CONFIG_NO_VECTORS
+#define CONFIG_NO_VECTORS 0
+#endif
+#ifndef CONFIG_TRACE
+#define CONFIG_TRACE 0
+#endif
+
+// the app may use other MOBs, and CAN interrupts, so the exported
+// functions have to leave CANPAGE as they found it
+#if CONFIG_CAN_API && !CONFIG_CANPAGE_SAVE
+#error "CONFIG_CAN_API needs CONFIG_CANPAGE_SAVE"
+#endif
+
+// board profile, this must define F_CPU before <util/delay.h>
+#ifndef BOARD_HEADER
+#define BOARD_HEADER "boards/zeva_bms24.h"
+#endif
+#include BOARD_HEADER
+#include "can_bittiming.h"
+
+// the boot timing gives the microseconds per Timer1 count (F_CPU/1024) in
+// one byte, which is too small for a clock of 4 MHz or less
+#if CONFIG_BOOT_TIMING && (1024000000UL / F_CPU) > 255
+#error "CONFIG_BOOT_TIMING needs F_CPU above 4 MHz"
+#endif
 #include <util/delay.h>
 
 // CAN ID that must match to receive a message.
@@ -45,8 +141,34 @@
 // boot loader command available to match on any 4 bit command value. The
 // board ID portion (bits 7:4) will be replaced at run time with the
 // board ID.
-#define CANID       0x1B007100UL
-#define CANIDMASK   0x1FFFFFF0UL
+#define CANID       CANBOOT_CANID
+#define CANIDMASK   CANBOOT_CANIDMASK
+
+// the ID base and mask in use, these can come from the EEPROM config
+#if CONFIG_CAN_IDCFG
+#define CAN_ID_BASE can_id_base
+#define CAN_ID_MASK can_id_mask
+#else
+#define CAN_ID_BASE CANID
+#define CAN_ID_MASK CANIDMASK
+#endif
+
+// CAN ID for a boot loader command to or from this board
+#define BOARD_CANID(cmd) (CAN_ID_BASE + ((uint32_t)boardid << 4) + (cmd))
+
+// MOBs used by the boot loader
+// The overrun MOB has the same filter as the receive MOB. The CAN controller
+// uses the lowest matching MOB, so it only gets a message that arrives while
+// the receive MOB still holds the one before.
+#define TX_MOB 0
+#define RX_MOB 1
+#define OVR_MOB 2
+
+// number of transmit errors before a message is abandoned
+#define CAN_TX_RETRIES 16
+
+// CANSTMOB error flags
+#define CAN_TX_ERRMASK (_BV(BERR) | _BV(SERR) | _BV(CERR) | _BV(FERR) | _BV(AERR))
 
 // define timeouts used when waiting for messages
 // units are milliseconds
@@ -59,6 +181,63 @@
 #define EEP_APP_LEN ((uint16_t *)(E2END - 3))
 #define EEP_APP_CRC ((uint16_t *)(E2END - 1))
 
+// optional app version tag provided by the host at the end of a load
+// this is 2 more bytes below the boot flags
+#define EEP_APP_TAG ((uint16_t *)(E2END - 6))
+
+// boot loader option flags, one byte just below the image info
+// The flags are active low so that erased eeprom (0xFF) gives the default
+// behavior. The app (or a programmer) can write this byte to change it.
+#define EEP_BOOT_FLAGS ((uint8_t *)(E2END - 4))
+
+// when set, wait for the boot timeout before starting the app (default)
+// when clear, start a valid app immediately after a normal reset
+#define BOOTFLAG_WAIT 0
+
+// start of the boot section (CANBOOT_BOOT_START is passed from the Makefile)
+#define BOOT_START CANBOOT_BOOT_START
+
+#if CONFIG_DUAL_SLOT
+// The app flash is split in two equal slots. The app runs from the lower
+// slot, and a new image is loaded into the upper (staging) slot. This also
+// limits the size of the app to one slot.
+#define SLOT_SIZE CANBOOT_STAGE_ADDR
+#define STAGE_ADDR SLOT_SIZE
+
+// copy journal, below the other boot loader eeprom locations
+// This records a verified image in the staging slot that is being copied
+// to the app slot, and the next page to copy. If the copy is interrupted by
+// a reset, it is finished at the next boot. The app can also write it to
+// commit an image it wrote to the staging slot (see canboot_app.h).
+#define EEP_JRNL_STATE CANBOOT_EEP_JRNL_STATE
+#define EEP_JRNL_PAGE CANBOOT_EEP_JRNL_PAGE
+#define EEP_JRNL_LEN CANBOOT_EEP_JRNL_LEN
+#define EEP_JRNL_CRC CANBOOT_EEP_JRNL_CRC
+#define EEP_JRNL_TAG CANBOOT_EEP_JRNL_TAG
+
+// journal states, idle is erased eeprom
+#define JRNL_IDLE 0xFF
+#define JRNL_COPY CANBOOT_JRNL_COPY
+
+// the load is written to the staging slot
+#define LOAD_BASE STAGE_ADDR
+#else
+#define LOAD_BASE 0
+#endif
+
+// pseudo flag added to the reset cause when the app requested the boot
+// loader (MCUSR does not use this bit)
+#define BOOTREQF 7
+
+// boot timing uses Timer1 started at reset, with clock divided by 1024
+// the current count is the time since reset
+#define TIMER_CLKSEL (_BV(CS12) | _BV(CS10))
+#if CONFIG_BOOT_TIMING
+#define BOOT_TIMESTAMP(phase) do { bootshare.phase = TCNT1; } while (0)
+#else
+#define BOOT_TIMESTAMP(phase) do {} while (0)
+#endif
+
 // BOOTVER should be defined when firmware is built
 // a placeholder is used if it is not defined. The placeholder means
 // development, non-production version
@@ -72,11 +251,13 @@ static const uint8_t version[3] = {
 /** Boot loader command definitions. */
 enum CmdId {
     CMD_PING = 0,   ///< Check for boot loader device presence
-    CMD_REBOOT,     ///< Cause the target to reset (not implemented)
+    CMD_RUN,        ///< Verify the app and start it
     CMD_START,      ///< Start a program load
     CMD_DATA,       ///< Send 8 bytes of program data
     CMD_STOP,       ///< Finish program load and provide CRC
     CMD_REPORT,     ///< Reply from boot loader to all commands
+    CMD_ENTER = CANBOOT_CMD_ENTER,  ///< App request to enter the boot loader
+    CMD_STATS,      ///< Read a session statistics counter
 };
 
 /** Boot loader report definitions. */
@@ -85,8 +266,48 @@ enum RptId {
     RPT_READY,      ///< Ready for next DATA block
     RPT_END,        ///< All expected DATA blocks have been received
     RPT_DONE,       ///< Acknowledge completion of load success or failure
-    RPT_BOOT,       ///< Acknowledge imminent reboot (not used)
+    RPT_RUN,        ///< Reply to RUN, indicates if app is starting
     RPT_ERR,        ///< Bad command or other error condition
+    RPT_ANNOUNCE,   ///< Boot loader has started (not a reply)
+    RPT_STATS,      ///< Reply to STATS
+};
+
+/** PING info selectors.
+ *
+ * The first payload byte of a PING selects the value that is returned in
+ * bytes 5:6 of the PONG report.
+ */
+enum InfoId {
+    INFO_NONE = 0,  ///< No info, also used if PING has no payload
+    INFO_APP_LEN,   ///< Stored app image length
+    INFO_APP_CRC,   ///< Stored app image CRC
+    INFO_APP_TAG,   ///< Stored app version tag
+    INFO_STACK,     ///< Peak stack depth in bytes (needs CONFIG_STACK_PAINT)
+    INFO_RAM,       ///< Static RAM (.data, .bss and .noinit) in bytes
+    INFO_CAN_RXOVR, ///< Messages received while the receive MOB was full
+    INFO_CAN_TXERR, ///< Transmit errors
+    INFO_CAN_BUSOFF,///< Bus-off recoveries
+    INFO_CAN_ERRCNT,///< CAN error counters, TEC (low byte) and REC (high)
+};
+
+/** Session statistics counters.
+ *
+ * The payload byte of a STATS command selects the counter that is returned
+ * in bytes 5:6 of the STATS report. The times are in Timer1 ticks.
+ */
+enum StatId {
+    STAT_SESSIONS = 0,  ///< Boot loader sessions (did not go straight to app)
+    STAT_FRAMES,        ///< Frames received
+    STAT_BAD_CMDS,      ///< Commands answered with an ERR report
+    STAT_PAGES_ERASED,  ///< Flash pages erased by a load
+    STAT_PAGES_WRITTEN, ///< Flash pages written by a load
+    STAT_PAGES_SAME,    ///< Flash pages of a load that were already the same
+    STAT_CRC_FAILS,     ///< Loads that failed the CRC check at STOP
+    STAT_FLASH_TICKS,   ///< Time waiting for flash erase and write
+    STAT_IDLE_TICKS,    ///< Time waiting for the host during a load
+    STAT_COUNT,         ///< Number of counters
+    STAT_TICK_US = STAT_COUNT,  ///< Microseconds per tick (not a counter)
+    STAT_CLEAR = 0xFF,  ///< Clear all the counters
 };
 
 /** Receive message status. */
@@ -100,17 +321,59 @@ enum RcvStatus {
 // some code space could be saved by not saving and restoring CANPAGE in
 // various places. The code is all single thread with no interrupts, so it is
 // probably not necessary to save/restore the CANPAGE where it is used
+#if CONFIG_CANPAGE_SAVE
 #define SAVE_CANPAGE uint8_t _cansave = CANPAGE
 #define RESTORE_CANPAGE CANPAGE = _cansave
+#else
+#define SAVE_CANPAGE do {} while (0)
+#define RESTORE_CANPAGE do {} while (0)
+#endif
 #define SET_CANPAGE(p) do { CANPAGE = (p) << MOBNB0; } while (0)
 
 // convenience macros for manipulating LED used for signalling state
 // some code space could be saved by not using the LED
-// PORTING: change to match the GPIO used for the LED, or define to void
-// if no LED is used
-#define LED_ON()        do { PORTD |= _BV(PORTD3); } while (0)
-#define LED_OFF()       do { PORTD &= ~_BV(PORTD3); } while (0)
-#define LED_TOGGLE()    do { PIND = _BV(PORTD3); } while (0)
+// the LED GPIO is defined by the board profile
+#if CONFIG_LED
+#define LED_ON()        BOARD_LED_ON()
+#define LED_OFF()       BOARD_LED_OFF()
+#define LED_TOGGLE()    BOARD_LED_TOGGLE()
+#else
+#define LED_ON()        do {} while (0)
+#define LED_OFF()       do {} while (0)
+#define LED_TOGGLE()    do {} while (0)
+#endif
+
+// trace macros for timing with a logic analyzer
+// Each trace point is a bit in the board trace port. The board profile maps
+// the points to its spare pins, and several points can share one pin. When
+// tracing is off these compile to nothing.
+//
+// TRACE_RX    - pulse when a frame is received
+// TRACE_MSG   - high while process_message() runs
+// TRACE_FILL  - high while the page buffer is filled
+// TRACE_ERASE - high while a flash page is erased
+// TRACE_WRITE - high while a flash page is written
+// TRACE_TX    - pulse when a report has been sent
+#if CONFIG_TRACE
+#define TRACE_RX        BOARD_TRACE_RX
+#define TRACE_MSG       BOARD_TRACE_MSG
+#define TRACE_FILL      BOARD_TRACE_FILL
+#define TRACE_ERASE     BOARD_TRACE_ERASE
+#define TRACE_WRITE     BOARD_TRACE_WRITE
+#define TRACE_TX        BOARD_TRACE_TX
+#define TRACE_MASK      (_BV(TRACE_RX) | _BV(TRACE_MSG) | _BV(TRACE_FILL) \
+                         | _BV(TRACE_ERASE) | _BV(TRACE_WRITE) | _BV(TRACE_TX))
+#define TRACE_INIT()    do { BOARD_TRACE_DDR |= TRACE_MASK; } while (0)
+#define TRACE_ON(pt)    do { BOARD_TRACE_PORT |= _BV(pt); } while (0)
+#define TRACE_OFF(pt)   do { BOARD_TRACE_PORT &= ~_BV(pt); } while (0)
+#define TRACE_PULSE(pt) do { BOARD_TRACE_PIN = _BV(pt); \
+                             BOARD_TRACE_PIN = _BV(pt); } while (0)
+#else
+#define TRACE_INIT()    do {} while (0)
+#define TRACE_ON(pt)    do {} while (0)
+#define TRACE_OFF(pt)   do {} while (0)
+#define TRACE_PULSE(pt) do {} while (0)
+#endif
 
 /** Command ID of received message.
  *
@@ -149,49 +412,43 @@ static uint8_t rptbuf[8] = {
     0, 0, 0                         // spare bytes
 };
 
+/** Board ID, read once when the device is initialized. */
+static uint8_t boardid;
+
 /** Receive message counter. Rolls over. */
 static uint8_t rxcount = 0;
 
-// Port Configuration
-//
-// This configuration is for a Zeva BMS-24 board.
-//
-//  | Port  |IO |PU | Usage                                 |
-//  |-------|---|---|---------------------------------------|
-//  | PB0   | I | - | NC                                    |
-//  | PB1   | I | - | NC                                    |
-//  | PB2   | I |PU | ID encoder position 2                 |
-//  | PB3   | O | - | LTC1 SCK (not used for bootloader)    |
-//  | PB4   | I | - | 5V (why?)                             |
-//  | PB6   | O | - | LTC2 CS                               |
-//  | PB7   | O | - | LTC2 SDI                              |
-//  | PC0   | I | - | NC                                    |
-//  | PC1   | O | - | Green LED                             |
-//  | PC2   | O | - | CAN TX                                |
-//  | PC3   | I | - | CAN RX                                |
-//  | PC4   | I | - | LTC1 SDO                              |
-//  | PC5   | O | - | LTC1 CS                               |
-//  | PC6   | O | - | LTC1 SDI                              |
-//  | PC7   | I | - | NC                                    |
-//  | PD0   | O | - | LTC2 SCK                              |
-//  | PD1   | I | - | tied to reset line (why?)             |
-//  | PD2   | O | - | prog MISO (needs configured?)         |
-//  | PD3   |I/O| - | prog MOSI / Red LED                   |
-//  | PD4   | I | - | prog SCK                              |
-//  | PD5   | I |PU | ID encoder position 8                 |
-//  | PD6   | I |PU | ID encoder position 1                 |
-//  | PD7   | I |PU | ID encoder position 4                 |
-//  | PE0   | I | - | RESET/                                |
-//  | PE1   | I | - | XTAL                                  |
-//  | PE2   | I | - | XTAL                                  |
-//
-// Notes:
-// - Battery chips LTCx are not used for boot loader
-// - Progamming pin functions are automatic so they dont need to be
-//   configured (PD2 not set to output)
-// - Even though PD3 is programming input, it is LED output so should
-//   be configured as output
-//
+#if CONFIG_CAN_IDCFG
+/** CAN ID base and filter mask, from the EEPROM config or the defaults. */
+static uint32_t can_id_base;
+static uint32_t can_id_mask;
+#endif
+
+#if CONFIG_CAN_DIAG
+/** CAN diagnostic counters since reset. These roll over. */
+static uint16_t rx_overruns;
+static uint16_t tx_errors;
+static uint16_t busoff_count;
+
+/** The overrun MOB holds the next message, see `receive_message()`. */
+static bool ovr_first;
+#endif
+
+/** Result of the last app check by `app_is_valid()`.
+ *
+ * 1 if the app is valid, 0 if not, or APP_UNCHECKED if the flash or the image
+ * info has changed since the last check.
+ */
+#define APP_UNCHECKED 0xFF
+static uint8_t app_check = APP_UNCHECKED;
+
+#if CONFIG_RUN
+/** Start the app after the current report is sent.
+ *
+ * Set by `process_message()` when a RUN command found a valid app.
+ */
+static bool run_app = false;
+#endif
 
 // if unit testing, dont use section attributes on the special
 // variable and function below. these only have meaning on actual
@@ -209,9 +466,91 @@ static uint8_t rxcount = 0;
 // before the variable can be used.
 volatile uint8_t reset_cause ATTRIBUTE((section (".noinit")));
 
+// data shared with the application across a reset, see canboot.h
+// The app must be able to find this, so it is not allocated by the compiler.
+// The linker places it at a fixed location at the top of RAM, above the
+// stack (see the Makefile).
+#ifndef UNIT_TEST
+extern volatile struct canboot_shared bootshare;
+#else
+volatile struct canboot_shared bootshare;
+#endif
+
+#if CONFIG_STATS
+// The statistics are kept in .noinit RAM so they last across resets. They are
+// only kept if the check word matches, since the app may use this RAM. The
+// check word is updated after each message.
+#define STATS_MAGIC 0x57A7
+
+/** Session statistics, indexed by `enum StatId`. These roll over. */
+static uint16_t stats[STAT_COUNT] ATTRIBUTE((section (".noinit")));
+static uint16_t stats_check ATTRIBUTE((section (".noinit")));
+
+#define STAT_INC(s)     do { ++stats[s]; } while (0)
+#define STAT_ADD(s, n)  do { stats[s] += (n); } while (0)
+#else
+#define STAT_INC(s)     do {} while (0)
+#define STAT_ADD(s, n)  do {} while (0)
+#endif
+
+// RAM layout symbols from the linker. Static variables are from __data_start
+// to _end, and the stack grows down from __stack to meet them.
+// The unit test uses a small array in place of RAM.
+#ifndef UNIT_TEST
+extern uint8_t __data_start;
+extern uint8_t _end;
+extern uint8_t __stack;
+#define RAM_STATIC_START (&__data_start)
+#define RAM_STATIC_END (&_end)
+#define RAM_STACK_TOP (&__stack)
+#else
+uint8_t test_ram[64];
+#define RAM_STATIC_START (&test_ram[0])
+#define RAM_STATIC_END (&test_ram[16])
+#define RAM_STACK_TOP (&test_ram[63])
+#endif
+
+// value used to fill unused RAM, to find the stack high-water mark
+#define STACK_PAINT 0xC5
+
+#if CONFIG_STACK_PAINT
+// Runs early in C startup, before anything is on the stack.
+// Fills all the RAM between the static variables and the top of the stack
+// with a known pattern. The peak stack depth is found later by looking for
+// the lowest address that was changed.
+// This is treated as part of the C init sequence and is not a callable
+// function. The loop is in assembly so that the compiler can not turn it into
+// a call to memset(), which would run before the stack is usable.
+void paint_stack(void) ATTRIBUTE((naked, used, section(".init3")));
+void paint_stack(void)  // cppcheck-suppress[unusedFunction]
+{
+#ifndef UNIT_TEST
+    // Z walks from _end up to and including __stack
+    __asm__ __volatile__ (
+        "    ldi r30, lo8(_end)\n"
+        "    ldi r31, hi8(_end)\n"
+        "    ldi r24, %0\n"
+        "    ldi r25, hi8(__stack)\n"
+        "    rjmp 2f\n"
+        "1:  st Z+, r24\n"
+        "2:  cpi r30, lo8(__stack)\n"
+        "    cpc r31, r25\n"
+        "    brlo 1b\n"
+        "    breq 1b\n"
+        : : "M" (STACK_PAINT) : "r24", "r25", "r30", "r31", "memory");
+#else
+    for (uint8_t *p = RAM_STATIC_END; p <= RAM_STACK_TOP; ++p) {
+        *p = STACK_PAINT;
+    }
+#endif
+}
+#endif
+
 // Runs early in C startup
 // Reads the MCUSR to determine reset cause, stores the value and
-// clears the reg (per the data sheet)
+// clears the reg (per the data sheet). Also checks for a boot request left
+// by the app, which is consumed so that it only applies to this reset.
+// Starts the timer used for the boot timing that is handed to the app.
 // This is treated as part of the C init sequence and is not a callable
 // function.
 void get_reset_cause(void) ATTRIBUTE((naked, used, section(".init3")));
@@ -220,65 +559,140 @@ void get_reset_cause(void)  // cppcheck-suppress[unusedFunction]
     reset_cause = MCUSR;
     MCUSR = 0;
     wdt_disable();
+    if (bootshare.request == CANBOOT_REQUEST_MAGIC) {
+        reset_cause |= _BV(BOOTREQF);
+    }
+    bootshare.request = 0;
+
+#if CONFIG_BOOT_TIMING || CONFIG_STATS
+    // start the timer for the boot timing and statistics
+    TCCR1B = TIMER_CLKSEL;
+#endif
+#if CONFIG_BOOT_TIMING
+    bootshare.t_init = 0;
+    bootshare.t_window = 0;
+    bootshare.t_crc = 0;
+    bootshare.t_jump = 0;
+    bootshare.tick_us = (uint8_t)(1024000000UL / F_CPU);
+    bootshare.reset_cause = reset_cause;
+#endif
+}
+
+#if CONFIG_NO_VECTORS
+// Minimal replacement for the C runtime startup code, used when linking
+// with -nostartfiles. The boot loader does not use interrupts so it does
+// not need the vector table. This is first in the boot section, so it runs
+// at reset. It does what the runtime startup does before the .init3 code
+// above: clear the zero register and status, and set up the stack. The
+// .data and .bss init code still comes from libgcc.
+void boot_start(void) ATTRIBUTE((naked, used, section(".init0")));
+void boot_start(void)   // cppcheck-suppress[unusedFunction]
+{
+    __asm__ __volatile__ ("clr __zero_reg__");
+    SREG = 0;
+    SP = (uint16_t)&__stack;
 }
 
-/** Get the assigned 4-bit board ID
+// Runs main() at the end of the C init sequence. If main() returns, loop
+// here until the watchdog resets the MCU (same as the runtime library).
+int main(void);
+void boot_main(void) ATTRIBUTE((naked, used, section(".init9")));
+void boot_main(void)    // cppcheck-suppress[unusedFunction]
+{
+    main();
+    for (;;)
+    {}
+}
+#endif
+
+#if CONFIG_STACK_PAINT
+/** Get the peak stack depth
+ *
+ * Finds the lowest RAM address that no longer has the paint pattern. This is
+ * only meaningful if the stack was painted at startup.
  *
- * PORTING: this function can be changed to support other board ID schemes.
- * For example, the board ID could be stored in EEPROM.
+ * @returns the most bytes that have been used on the stack since reset
  */
-static uint8_t get_boardid(void)
-{
-    // THIS IMPLEMENTATION IS SPECIFIC TO ZEVA BMS-24 BOARDS
-    //
-    // Because the encoder bits are scattered among GPIOs and not in order
-    // on a port, there is not an easier way to do this other than to check
-    // every bit.
-    uint8_t boardid = 0;
-    if (!(PIND & _BV(PD5))) {
-        boardid += 8;
+static uint16_t stack_peak(void)
+{
+    const uint8_t *p = RAM_STATIC_END;
+    while ((p <= RAM_STACK_TOP) && (*p == STACK_PAINT)) {
+        ++p;
     }
-    if (!(PIND & _BV(PD7))) {
-        boardid += 4;
+    return (uint16_t)(RAM_STACK_TOP + 1 - p);
+}
+#endif
+
+/** Compute the CRC of an image in flash
+ *
+ * @param base flash address of the start of the image
+ * @param len length of the image in bytes
+ *
+ * @returns the CRC of the image
+ */
+static uint16_t image_crc(uint16_t base, uint16_t len)
+{
+    uint16_t crc = 0;
+    for (uint16_t addr = base; addr < (base + len); ++addr) {
+        crc = _crc16_update(crc, pgm_read_byte(addr));
     }
-    if (!(PINB & _BV(PB2))) {
-        boardid += 2;
+    return crc;
+}
+
+/** Check app integrity
+ *
+ * Computes the CRC over the stored image in flash and compares it with the
+ * CRC saved in eeprom at the end of the load. The result is kept in
+ * `app_check` and reused until a load changes the flash or the image info,
+ * so a boot only computes the CRC once.
+ *
+ * @returns true if the app image is okay
+ */
+static bool app_is_valid(void)
+{
+    if (app_check != APP_UNCHECKED) {
+        return app_check;
     }
-    if (!(PIND & _BV(PD6))) {
-        boardid += 1;
+
+    uint16_t len = eeprom_read_word(EEP_APP_LEN);   // length of image
+
+    // no point checking if there is no image, or erased eeprom
+    if (len > FLASHEND) {
+        app_check = 0;
+        return false;
     }
-    return boardid;
+
+    // compute the CRC over the stored image in flash
+    uint16_t crc = image_crc(0, len);
+    uint16_t stored_crc = eeprom_read_word(EEP_APP_CRC);
+    BOOT_TIMESTAMP(t_crc);
+
+    app_check = (crc == stored_crc);
+    return app_check;
 }
 
-/** Initialize the MCU GPIO and CAN peripheral */
-static void device_init(void)
+/** Initialize the CAN peripheral
+ *
+ * Resets the CAN controller, sets the bit timing, disables all the MOBs and
+ * then enables the controller. After this, MOBs can be set up for receive
+ * with `can_rx_setup()`.
+ *
+ * This function is exported to the app (see canboot.h).
+ */
+void can_init(void) ATTRIBUTE((used, externally_visible));
+void can_init(void)
 {
-    // PORTING: set the GPIO configurations here to match the hardware
-    //
-    // set GPIO directions
-    DDRB = 0;                       // LTC outputs not enabled for boot loader
-    DDRC = _BV(DDC1) | _BV(DDC2);   // CAN TX and green LED
-    DDRD = _BV(DDD3);               // Red LED
-
-    // set pullups for ID encoder
-    PORTB = _BV(PORTB2);
-    PORTC = 0;
-    PORTD = _BV(PORTD5) | _BV(PORTD6) | _BV(PORTD7);
+    SAVE_CANPAGE;
 
-    // CAN init
     // reset CAN controller
     CANGCON = _BV(SWRES);
     // a delay is needed after reset - not sure how long is required
     _delay_ms(1);
 
-    // PORTING: the CAN timing register values need to be adjusted to
-    // match the clock frequency, if not 8 MHz. Also the CAN bus rate can be
-    // changed here.
-    //
-    // CAN timing for 250 khz, TQ=0.5, taken from data sheet table, 8MHz clk
-    CANBT1 = 0x06;
-    CANBT2 = 0x04;
-    CANBT3 = 0x13;
+    // CAN timing computed from F_CPU and CAN_BITRATE (see can_bittiming.h)
+    CANBT1 = CANBT1_VAL;
+    CANBT2 = CANBT2_VAL;
+    CANBT3 = CANBT3_VAL;
 
     // disable all the MOBs before enabling controller
     for (uint8_t i = 0; i < 6; ++i)
@@ -288,53 +702,130 @@ static void device_init(void)
         CANSTMOB = 0;       // clear all status
     }
 
-    // set up MOB1 to receive
-    SET_CANPAGE(1);         // select MOB1
+    // enable CAN controller
+    CANGCON = _BV(ENASTB);
+
+    RESTORE_CANPAGE;
+}
+
+// write a 29-bit CAN ID to the ID tag registers of the selected MOB
+// this also clears RTRTAG and RB0TAG (data frame)
+static void write_canidt(uint32_t id)
+{
+    CANIDT4 = (uint8_t)(id << IDT0);
+    CANIDT3 = (uint8_t)(id >> 5);
+    CANIDT2 = (uint8_t)(id >> 13);
+    CANIDT1 = (uint8_t)(id >> 21);
+}
+
+/** Set up a MOB to receive 29-bit ID messages
+ *
+ * The MOB receives the next message where the ID matches `id` for every bit
+ * that is set in `mask`. After a message is received with `can_receive()`,
+ * the MOB is enabled again with the same ID and mask.
+ *
+ * This function is exported to the app (see canboot.h).
+ *
+ * @param mob the MOB number to use for receive
+ * @param id the 29-bit CAN ID to match
+ * @param mask the bits of the CAN ID that must match
+ */
+void can_rx_setup(uint8_t mob, uint32_t id, uint32_t mask) ATTRIBUTE((used, externally_visible));
+void can_rx_setup(uint8_t mob, uint32_t id, uint32_t mask)
+{
+    SAVE_CANPAGE;
+    SET_CANPAGE(mob);
+
     // set up CAN ID and mask. Using 29-bit ID
-    uint8_t boardid = get_boardid();
-    CANIDT4 = boardid << IDT4;
-    CANIDT3 = (uint8_t)(CANID >> 5) + (boardid >> 1);
-    CANIDT2 = (uint8_t)(CANID >> 13);
-    CANIDT1 = (uint8_t)(CANID >> 21);
-    CANIDM4 = (uint8_t)(CANIDMASK << IDT0);
-    CANIDM3 = (uint8_t)(CANIDMASK >> 5);
-    CANIDM2 = (uint8_t)(CANIDMASK >> 13);
-    CANIDM1 = (uint8_t)(CANIDMASK >> 21);
+    // IDEMSK and RTRMSK are left clear
+    write_canidt(id);
+    CANIDM4 = (uint8_t)(mask << IDT0);
+    CANIDM3 = (uint8_t)(mask >> 5);
+    CANIDM2 = (uint8_t)(mask >> 13);
+    CANIDM1 = (uint8_t)(mask >> 21);
 
     // enable receive
+    CANSTMOB = 0;
     CANCDMOB = _BV(CONMOB1) | _BV(IDE) | 8;
 
-    // enable CAN controller
-    CANGCON = _BV(ENASTB);
+    RESTORE_CANPAGE;
 }
 
-/** Send boot loader REPORT message
+/** Check a receive MOB for a new message (non-blocking).
  *
- * Sends a REPORT message on the CAN bus, using the boot loader defined CAN ID
- * for a REPORT, combined with this board ID.
+ * If a message has been received, its ID and payload are copied out and the
+ * MOB is enabled again for the next message.
+ *
+ * This function is exported to the app (see canboot.h).
  *
+ * @param mob the MOB number that was set up with `can_rx_setup()`
+ * @param pid where to store the 29-bit ID of the message
+ * @param pbuf where to store the payload, must have room for 8 bytes
+ *
+ * @returns the payload length, or CANBOOT_NO_MSG if there is no new message
+ */
+uint8_t can_receive(uint8_t mob, uint32_t *pid, uint8_t *pbuf) ATTRIBUTE((used, externally_visible));
+uint8_t can_receive(uint8_t mob, uint32_t *pid, uint8_t *pbuf)
+{
+    uint8_t len = CANBOOT_NO_MSG;
+
+    SAVE_CANPAGE;
+    SET_CANPAGE(mob);
+
+    // a message has been received
+    if (CANSTMOB & _BV(RXOK)) {
+        *pid = ((uint32_t)CANIDT1 << 21) | ((uint32_t)CANIDT2 << 13)
+             | ((uint16_t)CANIDT3 << 5) | (CANIDT4 >> IDT0);
+
+        len = CANCDMOB & 0x0f;      // get the DLC
+
+        // extract the payload
+        for (uint8_t idx = 0; idx < len; ++idx) {
+            pbuf[idx] = CANMSG;
+        }
+
+        // clear the status and re-enable the receiver
+        CANSTMOB = 0;
+        CANCDMOB = _BV(CONMOB1) | _BV(IDE) | 8;     // always use 8 for DLC
+    }
+
+    RESTORE_CANPAGE;
+    return len;
+}
+
+/** Send a 29-bit ID message and wait for it to go out
+ *
+ * The CAN controller retries the message after a transmit error. The
+ * message is abandoned after CAN_TX_RETRIES errors, or if the controller goes
+ * bus-off.
+ *
+ * This function is exported to the app (see canboot.h).
+ *
+ * @param mob the MOB number to use for transmit
+ * @param id the 29-bit CAN ID
  * @param len number of bytes in payload
  * @param pmsg point to buffer of payload  bytes
+ *
+ * @returns the number of transmit errors, with CANBOOT_TX_FAIL set if the
+ *          message was not sent
  */
-static void send_message(uint8_t len, const uint8_t *pmsg)
+uint8_t can_send(uint8_t mob, uint32_t id, uint8_t len, const uint8_t *pmsg) ATTRIBUTE((used, externally_visible));
+uint8_t can_send(uint8_t mob, uint32_t id, uint8_t len, const uint8_t *pmsg)
 {
-    // wait for MOB0 to be not busy
-    while (CANEN2 & _BV(ENMOB0))
+    uint8_t errs = 0;
+
+    // wait for the MOB to be not busy
+    while (CANEN2 & _BV(mob))
     {}
 
-    // select MOB0
     SAVE_CANPAGE;
-    SET_CANPAGE(0);
+    SET_CANPAGE(mob);
 
     // clear any lingering status
     CANSTMOB = 0;
 
     // set up CAN ID - 29-bit addressing
-    uint8_t boardid = get_boardid();
-    CANIDT4 = (uint8_t)(boardid << IDT4) + (uint8_t)(CMD_REPORT << IDT0);
-    CANIDT3 = (uint8_t)(CANID >> 5) + (boardid >> 1);
-    CANIDT2 = (uint8_t)(CANID >> 13);
-    CANIDT1 = (uint8_t)(CANID >> 21);
+    write_canidt(id);
 
     // set the message payload
     for (uint8_t i = 0; i < len; ++i)
@@ -346,13 +837,209 @@ static void send_message(uint8_t len, const uint8_t *pmsg)
     CANCDMOB = _BV(CONMOB0) | _BV(IDE) | len;  // IDE=29-bit, DLC
 
     // wait for transmission complete
-    while (!CANSTMOB)
-    {}
+    for (;;) {
+        uint8_t status = CANSTMOB;
+        if (status & _BV(TXOK)) {
+            break;
+        }
+        if (status & CAN_TX_ERRMASK) {
+            // clear only the error flags, writing 1 has no effect
+            CANSTMOB = (uint8_t)~CAN_TX_ERRMASK;
+            if (++errs >= CAN_TX_RETRIES) {
+                errs |= CANBOOT_TX_FAIL;
+                break;
+            }
+        }
+        if (CANGSTA & _BV(BOFF)) {
+            errs |= CANBOOT_TX_FAIL;
+            break;
+        }
+    }
 
     // disable the MOB and clear status
     CANCDMOB = 0;
     CANSTMOB = 0;
     RESTORE_CANPAGE;
+    return errs;
+}
+
+/** Erase a flash page
+ *
+ * @param addr any byte address in the page
+ */
+static void erase_page(uint16_t addr)
+{
+    TRACE_ON(TRACE_ERASE);
+    boot_page_erase_safe(addr);     // erase the page
+    boot_spm_busy_wait();           // wait for done
+    TRACE_OFF(TRACE_ERASE);
+}
+
+/** Program a flash page from the page buffer
+ *
+ * The page must be erased first.
+ *
+ * @param addr any byte address in the page
+ */
+static void write_page(uint16_t addr)
+{
+    TRACE_ON(TRACE_WRITE);
+    boot_page_write_safe(addr);     // write the page
+    boot_spm_busy_wait();           // wait for done
+    TRACE_OFF(TRACE_WRITE);
+    boot_rww_enable();              // enable app flash
+}
+
+#if CONFIG_CAN_API
+/** Program a page of app flash
+ *
+ * Fills the page buffer from `pbuf`, then erases and writes the page. This
+ * will not write to the boot section. Interrupts are disabled while this runs
+ * because the app interrupt vectors can not be read during the write.
+ *
+ * This function is exported to the app (see canboot.h).
+ *
+ * @param addr byte address of the start of the page
+ * @param pbuf SPM_PAGESIZE bytes of data for the page
+ *
+ * @returns 0 if the page was written, 1 if the address is not allowed
+ */
+uint8_t flash_write_page(uint16_t addr, const uint8_t *pbuf) ATTRIBUTE((used, externally_visible));
+uint8_t flash_write_page(uint16_t addr, const uint8_t *pbuf)
+{
+    if ((addr >= BOOT_START) || (addr & (SPM_PAGESIZE - 1))) {
+        return 1;
+    }
+
+    uint8_t sreg = SREG;
+    cli();
+    TRACE_ON(TRACE_FILL);
+    for (uint16_t i = 0; i < SPM_PAGESIZE; i += 2) {
+        boot_page_fill_safe(addr + i, pbuf[i] + (pbuf[i + 1] << 8));
+    }
+    TRACE_OFF(TRACE_FILL);
+    erase_page(addr);
+    write_page(addr);
+    SREG = sreg;
+    return 0;
+}
+#endif
+
+#if CONFIG_CAN_API && !defined(UNIT_TEST)
+// Jump table for the CAN driver functions exported to the app. The linker
+// places this at a fixed address at the end of the boot section (see the
+// Makefile and canboot.h). The first word is the API version, then one
+// jump per function. New entries must only be added at the end so that an
+// app built for an older version keeps working.
+void can_api_table(void) ATTRIBUTE((naked, used, section(".canapi")));
+void can_api_table(void)    // cppcheck-suppress[unusedFunction]
+{
+    __asm__ __volatile__ (
+        ".word %0\n\t"
+        "rjmp can_init\n\t"
+        "rjmp can_rx_setup\n\t"
+        "rjmp can_receive\n\t"
+        "rjmp can_send\n\t"
+        "rjmp flash_write_page\n\t"
+        :: "n" (CANBOOT_API_VERSION));
+}
+#endif
+
+/** Send boot loader REPORT message
+ *
+ * Sends a REPORT message on the CAN bus, using the boot loader defined CAN ID
+ * for a REPORT, combined with this board ID.
+ *
+ * @param len number of bytes in payload
+ * @param pmsg point to buffer of payload  bytes
+ */
+static void send_message(uint8_t len, const uint8_t *pmsg)
+{
+    uint8_t errs = can_send(TX_MOB, BOARD_CANID(CMD_REPORT), len, pmsg);
+    TRACE_PULSE(TRACE_TX);
+#if CONFIG_CAN_DIAG
+    tx_errors += errs & ~CANBOOT_TX_FAIL;
+#else
+    (void)errs;
+#endif
+}
+
+/** Start the CAN peripheral and set up the boot loader MOBs */
+static void can_start(void)
+{
+    can_init();
+    can_rx_setup(RX_MOB, BOARD_CANID(0), CAN_ID_MASK);
+#if CONFIG_CAN_DIAG
+    can_rx_setup(OVR_MOB, BOARD_CANID(0), CAN_ID_MASK);
+#endif
+}
+
+#if CONFIG_CAN_IDCFG
+/** Load the CAN ID base and mask
+ *
+ * Uses the EEPROM config if its CRC matches, otherwise the defaults. The low
+ * byte of the base is for the board ID and command, so it is cleared, and
+ * the board ID bits always have to match.
+ */
+static void can_config_load(void)
+{
+    const uint8_t *p = (const uint8_t *)CANBOOT_EEP_CAN_BASE;
+    uint16_t crc = CANBOOT_CANCFG_CRC_INIT;
+    for (uint8_t i = 0; i < 8; ++i) {
+        crc = _crc16_update(crc, eeprom_read_byte(p + i));
+    }
+    if (crc == eeprom_read_word(CANBOOT_EEP_CAN_CRC)) {
+        can_id_base = eeprom_read_dword(CANBOOT_EEP_CAN_BASE) & 0x1FFFFF00UL;
+        can_id_mask = (eeprom_read_dword(CANBOOT_EEP_CAN_MASK) | 0xF0) & CANIDMASK;
+    } else {
+        can_id_base = CANID;
+        can_id_mask = CANIDMASK;
+    }
+}
+#endif
+
+#if CONFIG_CAN_DIAG
+/** Recover from CAN bus-off
+ *
+ * The CAN controller stops when it goes bus-off. If that happened, it is
+ * counted and the CAN peripheral is started again.
+ */
+static void can_check_busoff(void)
+{
+    if (CANGIT & _BV(BOFFIT)) {
+        ++busoff_count;
+        can_start();    // this also clears the interrupt flags
+    }
+}
+#endif
+
+/** Initialize the MCU GPIO and CAN peripheral
+ *
+ * When the CAN peripheral is running, an ANNOUNCE report is sent so that a
+ * host can see that the boot loader has started without polling for it.
+ */
+static void device_init(void)
+{
+    // GPIO configuration is in the board profile
+    board_gpio_init();
+    TRACE_INIT();
+
+    // CAN init, and receive for boot loader messages for this board
+    boardid = board_get_id();
+#if CONFIG_CAN_IDCFG
+    can_config_load();
+#endif
+    can_start();
+
+#if CONFIG_ANNOUNCE
+    // announce the boot loader, with app status and the reason for the boot
+    rptbuf[4] = RPT_ANNOUNCE;
+    rptbuf[5] = app_is_valid();
+    rptbuf[6] = reset_cause;
+    send_message(8, rptbuf);
+#endif
+
+    BOOT_TIMESTAMP(t_init);
 }
 
 /** Check for new received messages (non-blocking).
@@ -365,36 +1052,199 @@ static void send_message(uint8_t len, const uint8_t *pmsg)
  */
 static enum RcvStatus receive_message(void)
 {
-    enum RcvStatus ret = MSG_NONE;
+    uint32_t id;
+#if CONFIG_CAN_DIAG
+    // The overrun MOB gets a message when the receive MOB was still full, so
+    // it is newer than the one in the receive MOB but older than any the
+    // receive MOB gets once it is enabled again. A message that is in the
+    // overrun MOB right after the receive MOB is read got there first, since
+    // a new frame takes much longer than that. It is the next one handled.
+    uint8_t len = CANBOOT_NO_MSG;
+    if (ovr_first) {
+        ovr_first = false;
+    } else {
+        len = can_receive(RX_MOB, &id, msgbuf);
+        if (len != CANBOOT_NO_MSG) {
+            SET_CANPAGE(OVR_MOB);
+            ovr_first = CANSTMOB & _BV(RXOK);
+        }
+    }
+    if (len == CANBOOT_NO_MSG) {
+        len = can_receive(OVR_MOB, &id, msgbuf);
+        if (len != CANBOOT_NO_MSG) {
+            ++rx_overruns;
+        }
+    }
+#else
+    uint8_t len = can_receive(RX_MOB, &id, msgbuf);
+#endif
+    if (len == CANBOOT_NO_MSG) {
+        return MSG_NONE;
+    }
 
-    // check MOB1
-    SAVE_CANPAGE;
-    SET_CANPAGE(1);
+    // since we are only matching on messages with this board ID,
+    // there is no need to check the message ID, except to extract
+    // the 4-bit command field
+    cmdid = id & 0x0F;
+    msglen = len;
+    STAT_INC(STAT_FRAMES);
+    TRACE_PULSE(TRACE_RX);
+    return MSG_READY;
+}
 
-    // a message has been received
-    if (CANSTMOB & _BV(RXOK)) {
-        // since we are only matching on messages with this board ID,
-        // there is no need to check the message ID, except to extract
-        // the 4-bit command field
-        cmdid = (CANIDT4 >> IDT0) & 0x0F;
+// the app reset vector. The unit test points this at a test function to
+// catch the jump to the app.
+static void(*swreset)(void) = 0;
 
-        msglen = CANCDMOB & 0x0f;   // get the DLC
+/** Start the app
+ *
+ * Puts the hardware back in the reset state and jumps to the app. The app
+ * must have been checked already.
+ */
+static void start_app(void)
+{
+    // disable WDT
+    MCUSR = 0;      // not sure if this is required
+    wdt_disable();
 
-        // extract the payload
-        for (uint8_t idx = 0; idx < msglen; ++idx) {
-            msgbuf[idx] = CANMSG;
+    // set all the IO back to the reset state
+    DDRB = 0;
+    DDRC = 0;
+    DDRD = 0;
+    PORTB = 0;
+    PORTC = 0;
+    PORTD = 0;
+
+    // reset the CAN controller (disables it)
+    CANGCON = _BV(SWRES);
+
+#if CONFIG_BOOT_TIMING || CONFIG_STATS
+    // last boot timestamp, and put the timer back to reset state
+    BOOT_TIMESTAMP(t_jump);
+    TCCR1B = 0;
+    TCNT1 = 0;
+#endif
+
+    // jump to application
+    swreset();  // cppcheck-suppress[nullPointer]
+}
+
+/** Program a page of a load from the page buffer
+ *
+ * The page is always erased and then written. The time spent waiting for the
+ * flash is added to the statistics.
+ *
+ * @param addr any byte address in the page
+ */
+static void load_page(uint16_t addr)
+{
+#if CONFIG_STATS
+    uint16_t start = TCNT1;
+#endif
+    app_check = APP_UNCHECKED;
+    erase_page(addr);
+    STAT_INC(STAT_PAGES_ERASED);
+    write_page(addr);
+    STAT_INC(STAT_PAGES_WRITTEN);
+    STAT_ADD(STAT_FLASH_TICKS, TCNT1 - start);
+}
+
+#if CONFIG_STATS
+/** Compute the check word of the statistics */
+static uint16_t stats_sum(void)
+{
+    uint16_t sum = STATS_MAGIC;
+    for (uint8_t i = 0; i < STAT_COUNT; ++i) {
+        sum += stats[i];
+    }
+    return sum;
+}
+
+/** Clear the statistics */
+static void stats_clear(void)
+{
+    for (uint8_t i = 0; i < STAT_COUNT; ++i) {
+        stats[i] = 0;
+    }
+}
+
+/** Update the check word after the statistics changed */
+static void stats_seal(void)
+{
+    stats_check = stats_sum();
+}
+
+/** Check the statistics at boot
+ *
+ * The statistics from before the reset are kept unless this is a power on or
+ * brown-out reset, or the app has written over them.
+ */
+static void stats_start(void)
+{
+    if ((reset_cause & (_BV(PORF) | _BV(BORF))) || (stats_check != stats_sum())) {
+        stats_clear();
+    }
+    stats_seal();
+}
+#endif
+
+#if CONFIG_DUAL_SLOT
+/** Copy the image in the staging slot to the app slot
+ *
+ * The image must already be verified and recorded in the journal. The copy
+ * starts at the page in the journal, which is updated after each page, so
+ * this can be called again to finish a copy that was interrupted. When the
+ * copy is done, the image info is updated and the journal is cleared.
+ */
+static void slot_copy(void)
+{
+    uint16_t len = eeprom_read_word(EEP_JRNL_LEN);
+    uint8_t page = eeprom_read_byte(EEP_JRNL_PAGE);
+
+    for (uint16_t addr = page * SPM_PAGESIZE; addr < len;
+         addr += SPM_PAGESIZE) {
+        for (uint16_t i = 0; i < SPM_PAGESIZE; i += 2) {
+            boot_page_fill_safe(addr + i, pgm_read_word(STAGE_ADDR + addr + i));
         }
+        load_page(addr);
+        eeprom_update_byte(EEP_JRNL_PAGE, ++page);
+        // the copy of a large image takes longer than the watchdog timeout
+        wdt_reset();
+    }
 
-        // clear the status and re-enable the receiver
-        CANSTMOB = 0;
-        CANCDMOB = _BV(CONMOB1) | _BV(IDE) | 8;     // always use 8 for DLC
+    // the app slot now has the new image
+    eeprom_update_word(EEP_APP_LEN, len);
+    eeprom_update_word(EEP_APP_CRC, eeprom_read_word(EEP_JRNL_CRC));
+#if CONFIG_APP_TAG
+    eeprom_update_word(EEP_APP_TAG, eeprom_read_word(EEP_JRNL_TAG));
+#endif
+    eeprom_update_byte(EEP_JRNL_STATE, JRNL_IDLE);
+    eeprom_busy_wait();
+}
 
-        ret = MSG_READY;
+/** Finish a pending copy from the staging slot
+ *
+ * Called at boot. The journal is set either by an interrupted copy, or by
+ * the app after it wrote a new image to the staging slot itself. In both
+ * cases the staging slot is checked against the journal CRC first. If it does
+ * not match, the journal is cleared and the app is left as it is.
+ */
+static void slot_resume(void)
+{
+    if (eeprom_read_byte(EEP_JRNL_STATE) != JRNL_COPY) {
+        return;
     }
 
-    RESTORE_CANPAGE;
-    return ret;
+    uint16_t len = eeprom_read_word(EEP_JRNL_LEN);
+    if ((len <= SLOT_SIZE)
+     && (image_crc(STAGE_ADDR, len) == eeprom_read_word(EEP_JRNL_CRC))) {
+        slot_copy();
+    } else {
+        eeprom_update_byte(EEP_JRNL_STATE, JRNL_IDLE);
+        eeprom_busy_wait();
+    }
 }
+#endif
 
 /** Process any incoming message.
  *
@@ -410,6 +1260,11 @@ static void process_message(void)
     static uint16_t loadaddr = 0;   // byte address of current write
     static uint16_t loadlen = 0;    // load len from START command
     static uint16_t running_crc = 0;
+#if CONFIG_STATS
+    static uint8_t page_same;       // current page matches the flash so far
+#endif
+
+    TRACE_ON(TRACE_MSG);
 
     // a message is available so process according to command ID
     rptbuf[5] = 0;              // clear spare bytes
@@ -417,39 +1272,122 @@ static void process_message(void)
     rptbuf[7] = ++rxcount;      // receive message counter
 
     switch (cmdid) {
+#if CONFIG_CAN_API
+        // an ENTER from the app library is answered like a PING, when
+        // the boot loader is already running
+        case CMD_ENTER:
+            msglen = 0;
+            // fall through
+#endif
         case CMD_PING:
-            // send a PONG report
+        {
             rptbuf[4] = RPT_PONG;
+#if CONFIG_PING_INFO
+            // send a PONG report, with the info selected by the first
+            // payload byte, if there is one
+            enum InfoId info = msglen ? msgbuf[0] : INFO_NONE;
+            uint16_t val = 0;
+            switch (info) {
+                case INFO_APP_LEN:
+                    val = eeprom_read_word(EEP_APP_LEN);
+                    break;
+                case INFO_APP_CRC:
+                    val = eeprom_read_word(EEP_APP_CRC);
+                    break;
+                case INFO_APP_TAG:
+                    val = eeprom_read_word(EEP_APP_TAG);
+                    break;
+#if CONFIG_STACK_PAINT
+                case INFO_STACK:
+                    val = stack_peak();
+                    break;
+#endif
+                case INFO_RAM:
+                    val = (uint16_t)(RAM_STATIC_END - RAM_STATIC_START);
+                    break;
+#if CONFIG_CAN_DIAG
+                case INFO_CAN_RXOVR:
+                    val = rx_overruns;
+                    break;
+                case INFO_CAN_TXERR:
+                    val = tx_errors;
+                    break;
+                case INFO_CAN_BUSOFF:
+                    val = busoff_count;
+                    break;
+                case INFO_CAN_ERRCNT:
+                    val = CANTEC | (CANREC << 8);
+                    break;
+#endif
+                default:
+                    break;
+            }
+            rptbuf[5] = (uint8_t)val;
+            rptbuf[6] = (uint8_t)(val >> 8);
+#endif
             break;
+        }
+
+#if CONFIG_RUN
+        case CMD_RUN:
+            // verify the app. if it is okay then main loop starts it
+            // right after this report is sent
+            run_app = app_is_valid();
+            rptbuf[4] = RPT_RUN;
+            rptbuf[5] = run_app;    // 1 if starting, 0 if not valid
+            break;
+#endif
 
         case CMD_START:
             running_crc = 0;
             loadaddr = 0;
             loadlen = msgbuf[0] + (msgbuf[1] << 8);
             rptbuf[4] = RPT_READY;
+#if CONFIG_DUAL_SLOT
+            // the image has to fit in the staging slot
+            if (loadlen > SLOT_SIZE) {
+                loadlen = 0;
+                rptbuf[4] = RPT_ERR;
+            }
+#endif
             break;
 
         case CMD_DATA:
             // make sure we can load another block
             if (loadaddr < loadlen) {
                 // write 8 bytes to the page buffer
+                TRACE_ON(TRACE_FILL);
+#if CONFIG_STATS
+                // count pages that already had the data. They are still
+                // erased and written like the others.
+                if ((loadaddr % SPM_PAGESIZE) == 0) {
+                    page_same = 1;
+                }
+#endif
                 for (uint8_t i = 0; i < 8; i += 2) {
                     uint16_t w = msgbuf[i] + (msgbuf[i+1] << 8);
                     boot_page_fill_safe(loadaddr + i, w);
+#if CONFIG_STATS
+                    if (pgm_read_word(LOAD_BASE + loadaddr + i) != w) {
+                        page_same = 0;
+                    }
+#endif
                     // accumulate crc
                     running_crc = _crc16_update(running_crc, msgbuf[i]);
                     running_crc = _crc16_update(running_crc, msgbuf[i+1]);
                 }
+                TRACE_OFF(TRACE_FILL);
                 loadaddr += 8;  // advance to next 8-byte block
 
                 // if at the end of a page, or end of load, burn the block
                 if ((loadaddr >= loadlen)
                 || ((loadaddr % SPM_PAGESIZE) == 0)) {
-                    uint16_t page = loadaddr - 1;   // previous page
-                    boot_page_erase_safe(page);     // erase the page
-                    boot_page_write_safe(page);     // write the page
-                    boot_spm_busy_wait();           // wait for done
-                    boot_rww_enable();              // enable app flash
+#if CONFIG_STATS
+                    if (page_same) {
+                        STAT_INC(STAT_PAGES_SAME);
+                    }
+#endif
+                    load_page(LOAD_BASE + loadaddr - 1);  // previous page
 
                     // a flash page has now been programmed
                     // determine response based on end of load vs new page
@@ -466,26 +1404,72 @@ static void process_message(void)
         {
             // extract verification CRC from message
             uint16_t verify_crc = msgbuf[0] + (msgbuf[1] << 8);
+            app_check = APP_UNCHECKED;  // the image info may change
+#if CONFIG_APP_TAG
+            // the version tag is optional, erased value if not provided
+            uint16_t tag = 0xFFFF;
+            if (msglen >= 4) {
+                tag = msgbuf[2] + (msgbuf[3] << 8);
+            }
+#endif
 
             if (verify_crc == running_crc) {
                 // crc matches, so save CRC and image length in eeprom
                 rptbuf[5] = 1;  // set load status to OK
 
-                // update the image length and CRC in eeprom
+#if CONFIG_DUAL_SLOT
+                // the new image is good, record it in the journal and then
+                // copy it over the app
+                eeprom_update_word(EEP_JRNL_LEN, loadlen);
+                eeprom_update_word(EEP_JRNL_CRC, running_crc);
+#if CONFIG_APP_TAG
+                eeprom_update_word(EEP_JRNL_TAG, tag);
+#endif
+                eeprom_update_byte(EEP_JRNL_PAGE, 0);
+                eeprom_update_byte(EEP_JRNL_STATE, JRNL_COPY);
+                eeprom_busy_wait();
+                slot_copy();
+#else
+                // update the image length, CRC and tag in eeprom
                 eeprom_update_word(EEP_APP_LEN, loadlen);
                 eeprom_update_word(EEP_APP_CRC, running_crc);
+#if CONFIG_APP_TAG
+                eeprom_update_word(EEP_APP_TAG, tag);
+#endif
                 eeprom_busy_wait(); // make sure write done before continue
+#endif
 
             } else {
                 // crc doesnt match. dont save the crc or image length
                 // this will cause app start to fail at boot
+                // (with CONFIG_DUAL_SLOT the old app is still there)
                 rptbuf[5] = 0;  // load error indication
+                STAT_INC(STAT_CRC_FAILS);
             }
 
             rptbuf[4] = RPT_DONE;
             break;
         }
 
+#if CONFIG_STATS
+        case CMD_STATS:
+        {
+            uint8_t sel = msglen ? msgbuf[0] : STAT_SESSIONS;
+            uint16_t val = 0;
+            if (sel < STAT_COUNT) {
+                val = stats[sel];
+            } else if (sel == STAT_TICK_US) {
+                val = (uint16_t)(1024000000UL / F_CPU);
+            } else if (sel == STAT_CLEAR) {
+                stats_clear();
+            }
+            rptbuf[4] = RPT_STATS;
+            rptbuf[5] = (uint8_t)val;
+            rptbuf[6] = (uint8_t)(val >> 8);
+            break;
+        }
+#endif
+
         default:
             // in case of unknown command, send error report
             // with received command id
@@ -493,6 +1477,7 @@ static void process_message(void)
             rptbuf[5] = cmdid;
             break;
     }
+    TRACE_OFF(TRACE_MSG);
 }
 
 /** Check app integrity and start it
@@ -502,34 +1487,8 @@ static void process_message(void)
  */
 static void  attempt_app_start(void)
 {
-    static void(*swreset)(void) = 0;
-
-    // compute the CRC over the stored image in flash
-    uint16_t len = eeprom_read_word(EEP_APP_LEN);   // length of image
-    uint16_t crc = 0;
-    for (uint16_t addr = 0; addr < len; ++addr) {
-        crc = _crc16_update(crc, pgm_read_byte(addr));
-    }
-    uint16_t stored_crc = eeprom_read_word(EEP_APP_CRC);
-
-    // if the computed matches the stored, then start the app
-    if (crc == stored_crc) {
-        // disable WDT
-        MCUSR = 0;      // not sure if this is required
-        wdt_disable();
-
-        // set all the IO back to the reset state
-        DDRB = 0;
-        DDRC = 0;
-        DDRD = 0;
-        PORTB = 0;
-        PORTC = 0;
-        PORTD = 0;
-
-        // reset the CAN controller (disables it)
-        CANGCON = _BV(SWRES);
-        // jump to application
-        swreset();  // cppcheck-suppress[nullPointer]
+    if (app_is_valid()) {
+        start_app();
     }
 }
 
@@ -542,33 +1501,82 @@ static void  attempt_app_start(void)
 int MAIN(void)
 {
     cli();
-    device_init();
 
-    // enable the watchdog from this point
-    wdt_enable(WDTO_1S);
+#if CONFIG_STATS
+    stats_start();
+#endif
+
+#if CONFIG_DUAL_SLOT
+    // finish copying a new image if it was interrupted by a reset, or if
+    // the app wrote one to the staging slot
+    slot_resume();
+#endif
 
     // determine reset cause and timeout duration
     uint16_t timeout;
-    if (reset_cause & _BV(WDRF)) {
-        // if reset was due to WDT, either the app is trying to start the BL,
-        // or the boot loader is resetting itself due to error or timeout
+    if (reset_cause & (_BV(WDRF) | _BV(BOOTREQF))) {
+        // if reset was due to WDT or a boot request, either the app is
+        // trying to start the BL, or the boot loader is resetting itself
+        // due to error or timeout
         // In this case using the long timeout
         timeout = ACTIVITY_TIMEOUT;
     } else {
-        // otherwise we have normal reboot so use short timeout
+        // otherwise we have normal reboot. In zero-wait mode the app is
+        // started right away. If that returns then the app is not valid
+        // and the boot loader stays, using the short timeout
+        if (!(eeprom_read_byte(EEP_BOOT_FLAGS) & _BV(BOOTFLAG_WAIT))) {
+            attempt_app_start();
+        }
         timeout = BOOT_TIMEOUT;
     }
 
+    // the boot loader is staying, so this is a new session
+#if CONFIG_STATS
+    STAT_INC(STAT_SESSIONS);
+    stats_seal();
+    uint16_t t_sent = TCNT1;    // when the last report was sent
+#endif
+
+    device_init();
+
+    // enable the watchdog from this point
+    wdt_enable(WDTO_1S);
+
     // run forever in this loop until there is a command to reboot or
     // the timeout expires
     uint8_t blinkcount = 50;
     for (;;) {
         wdt_reset();
+#if CONFIG_CAN_DIAG
+        can_check_busoff();
+#endif
         // check for available incoming message
         enum RcvStatus status = receive_message();
         if (status == MSG_READY) {
+#if CONFIG_STATS
+            // time the host took to send the next message of a load
+            if ((rptbuf[4] == RPT_READY) || (rptbuf[4] == RPT_END)) {
+                STAT_ADD(STAT_IDLE_TICKS, TCNT1 - t_sent);
+            }
+#endif
             process_message();
             send_message(8, rptbuf);
+#if CONFIG_STATS
+            t_sent = TCNT1;
+            if (rptbuf[4] == RPT_ERR) {
+                STAT_INC(STAT_BAD_CMDS);
+            }
+            stats_seal();
+#endif
+#if CONFIG_RUN
+            // RUN command found a good app, so start it now that the
+            // report is sent
+            if (run_app) {
+                BOOT_TIMESTAMP(t_window);
+                LED_ON();
+                start_app();
+            }
+#endif
             // message was processed, reset timeout
             timeout = ACTIVITY_TIMEOUT;
 
@@ -585,6 +1593,7 @@ int MAIN(void)
             // check for timeout
             // if it times out, attempt to run application
             if (timeout-- == 0) {
+                BOOT_TIMESTAMP(t_window);
                 LED_ON();   // leave LED on while starting app
                 attempt_app_start();
                 // if the above returns, it means the app didnt start
@@ -58,17 +58,17 @@ void boot_page_fill_safe(uint16_t addr, uint16_t w)
 
 void boot_page_erase_safe(uint16_t addr)
 {
-    uint16_t page = addr / SPM_PAGESIZE;    // page number
-    uint16_t waddr = page * SPM_PAGESIZE;   // get page start address (word)
-    memset(&flashmem[waddr], 0xff, SPM_PAGESIZE / 2);
+    uint16_t page = addr / SPM_PAGESIZE;        // page number
+    uint16_t waddr = page * SPM_PAGESIZE / 2;   // page start address (word)
+    memset(&flashmem[waddr], 0xff, SPM_PAGESIZE);
     flash_rww_enabled = false;
 }
 
 void boot_page_write_safe(uint16_t addr)
 {
-    uint16_t page = addr / SPM_PAGESIZE;    // page number
-    uint16_t waddr = page * SPM_PAGESIZE;   // get page start address (word)
-    memcpy(&flashmem[waddr], flashbuf, SPM_PAGESIZE / 2);
+    uint16_t page = addr / SPM_PAGESIZE;        // page number
+    uint16_t waddr = page * SPM_PAGESIZE / 2;   // page start address (word)
+    memcpy(&flashmem[waddr], flashbuf, SPM_PAGESIZE);
     memset(flashbuf, 0xff, sizeof(flashbuf)); // clear the buffer for next use
     flash_rww_enabled = false;
 }
@@ -79,7 +79,9 @@ void boot_spm_busy_wait(void)
     }
 }
 
+// writing RWWSRE also clears the temp buffer
 void boot_rww_enable(void)
 {
     flash_rww_enabled = true;
+    memset(flashbuf, 0xff, SPM_PAGESIZE);
 }
@@ -39,6 +39,12 @@ void eep_reset(void)
     memset(eepmem, 0xFF, sizeof(eepmem));
 }
 
+uint8_t eeprom_read_byte(const uint8_t *addr)
+{
+    uintptr_t idx = (uintptr_t)addr;
+    return eepmem[idx];
+}
+
 uint16_t eeprom_read_word(const uint16_t *addr)
 {
     uintptr_t idx = (uintptr_t)addr;
@@ -46,6 +52,19 @@ uint16_t eeprom_read_word(const uint16_t *addr)
     return w;
 }
 
+uint32_t eeprom_read_dword(const uint32_t *addr)
+{
+    uintptr_t idx = (uintptr_t)addr;
+    return eepmem[idx] + ((uint32_t)eepmem[idx + 1] << 8)
+         + ((uint32_t)eepmem[idx + 2] << 16) + ((uint32_t)eepmem[idx + 3] << 24);
+}
+
+void eeprom_update_byte(uint8_t *addr, uint8_t val)
+{
+    uintptr_t idx = (uintptr_t)addr;
+    eepmem[idx] = val;
+}
+
 void eeprom_update_word(uint16_t *addr, uint16_t val)
 {
     uintptr_t idx = (uintptr_t)addr;
@@ -53,6 +72,15 @@ void eeprom_update_word(uint16_t *addr, uint16_t val)
     eepmem[idx + 1] = val >> 8;
 }
 
+void eeprom_update_dword(uint32_t *addr, uint32_t val)
+{
+    uintptr_t idx = (uintptr_t)addr;
+    eepmem[idx] = val;
+    eepmem[idx + 1] = val >> 8;
+    eepmem[idx + 2] = val >> 16;
+    eepmem[idx + 3] = val >> 24;
+}
+
 bool eeprom_is_ready(void)
 {
     return eeprom_ready;
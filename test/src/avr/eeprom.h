@@ -28,8 +28,12 @@
 // substitute header for the AVR avr/eeprom.h
 // a place to declare any interrupt functions used for unit testing
 
+extern uint8_t eeprom_read_byte(const uint8_t *);
 extern uint16_t eeprom_read_word(const uint16_t *);
+extern uint32_t eeprom_read_dword(const uint32_t *);
+extern void eeprom_update_byte(uint8_t *, uint8_t);
 extern void eeprom_update_word(uint16_t *, uint16_t);
+extern void eeprom_update_dword(uint32_t *, uint32_t);
 extern bool eeprom_is_ready(void);
 extern void eep_reset(void);
 
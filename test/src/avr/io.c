@@ -30,8 +30,9 @@
 
 volatile uint8_t *reg8_eval(struct reg8 *r)
 {
+    // after the data is used up, all accesses go to the last byte
     volatile uint8_t *ret = &r->data[r->idx];
-    if (r->idx < sizeof(r->data)) {
+    if (r->idx < sizeof(r->data) - 1) {
         ++r->idx;
     }
     return ret;
@@ -59,9 +60,14 @@ REG8_DEF(DDRC);
 REG8_DEF(DDRD);
 
 REG8_DEF(MCUSR);
+REG8_DEF(SREG);
 
 REG8_DEF(CANGCON);
 REG8_DEF(CANPAGE);
+REG8_DEF(CANGIT);
+REG8_DEF(CANGSTA);
+REG8_DEF(CANTEC);
+REG8_DEF(CANREC);
 REG8_DEF(CANEN2);
 REG8_DEF(CANCDMOB);
 REG8_DEF(CANMSG);
@@ -81,6 +87,10 @@ REG8_DEF(CANIDT2);
 REG8_DEF(CANIDT3);
 REG8_DEF(CANIDT4);
 
+REG8_DEF(TCCR1B);
+
+volatile uint16_t TCNT1_reg16;
+
 void reset_all(void)
 {
     PORTB_reg8.reset(&PORTB_reg8);
@@ -92,8 +102,13 @@ void reset_all(void)
     DDRC_reg8.reset(&DDRC_reg8);
     DDRD_reg8.reset(&DDRD_reg8);
     MCUSR_reg8.reset(&MCUSR_reg8);
+    SREG_reg8.reset(&SREG_reg8);
     CANGCON_reg8.reset(&CANGCON_reg8);
     CANPAGE_reg8.reset(&CANPAGE_reg8);
+    CANGIT_reg8.reset(&CANGIT_reg8);
+    CANGSTA_reg8.reset(&CANGSTA_reg8);
+    CANTEC_reg8.reset(&CANTEC_reg8);
+    CANREC_reg8.reset(&CANREC_reg8);
     CANEN2_reg8.reset(&CANEN2_reg8);
     CANCDMOB_reg8.reset(&CANCDMOB_reg8);
     CANMSG_reg8.reset(&CANMSG_reg8);
@@ -109,6 +124,8 @@ void reset_all(void)
     CANIDT2_reg8.reset(&CANIDT2_reg8);
     CANIDT3_reg8.reset(&CANIDT3_reg8);
     CANIDT4_reg8.reset(&CANIDT4_reg8);
+    TCCR1B_reg8.reset(&TCCR1B_reg8);
+    TCNT1_reg16 = 0;
 }
 
 void cli(void)
@@ -85,6 +85,8 @@ extern void reset_all(void);
 #define PORTB (*PORTB_reg8.eval(&PORTB_reg8))
 extern struct reg8 PORTB_reg8;
 
+#define PORTB0 0
+#define PORTB1 1
 #define PORTB2 2
 #define PB2 2
 
@@ -122,6 +124,10 @@ extern struct reg8 DDRD_reg8;
 
 #define MCUSR (*MCUSR_reg8.eval(&MCUSR_reg8))
 extern struct reg8 MCUSR_reg8;
+#define SREG (*SREG_reg8.eval(&SREG_reg8))
+extern struct reg8 SREG_reg8;
+#define PORF 0
+#define BORF 2
 #define WDRF 3
 
 #define CANGCON (*CANGCON_reg8.eval(&CANGCON_reg8))
@@ -129,6 +135,19 @@ extern struct reg8 CANGCON_reg8;
 #define SWRES 0
 #define ENASTB 1
 
+#define CANGIT (*CANGIT_reg8.eval(&CANGIT_reg8))
+extern struct reg8 CANGIT_reg8;
+#define BOFFIT 6
+
+#define CANGSTA (*CANGSTA_reg8.eval(&CANGSTA_reg8))
+extern struct reg8 CANGSTA_reg8;
+#define BOFF 2
+
+#define CANTEC (*CANTEC_reg8.eval(&CANTEC_reg8))
+extern struct reg8 CANTEC_reg8;
+#define CANREC (*CANREC_reg8.eval(&CANREC_reg8))
+extern struct reg8 CANREC_reg8;
+
 #define CANEN2 (*CANEN2_reg8.eval(&CANEN2_reg8))
 extern struct reg8 CANEN2_reg8;
 #define ENMOB0 0
@@ -152,7 +171,13 @@ extern struct reg8 CANCDMOB_reg8;
 
 #define CANSTMOB (*CANSTMOB_reg8.eval(&CANSTMOB_reg8))
 extern struct reg8 CANSTMOB_reg8;
+#define AERR 0
+#define FERR 1
+#define CERR 2
+#define SERR 3
+#define BERR 4
 #define RXOK 5
+#define TXOK 6
 
 #define CANIDT1 (*CANIDT1_reg8.eval(&CANIDT1_reg8))
 extern struct reg8 CANIDT1_reg8;
@@ -177,8 +202,18 @@ extern struct reg8 CANIDM4_reg8;
 extern struct reg8 CANMSG_reg8;
 #define CANMSG (*CANMSG_reg8.eval(&CANMSG_reg8))
 
+#define TCCR1B (*TCCR1B_reg8.eval(&TCCR1B_reg8))
+extern struct reg8 TCCR1B_reg8;
+#define CS10 0
+#define CS12 2
+
+// 16-bit timer register is just a variable
+#define TCNT1 TCNT1_reg16
+extern volatile uint16_t TCNT1_reg16;
+
 #define SPM_PAGESIZE (128)
 #define FLASHEND (0x3FFF)
+#define RAMEND (0x4FF)
 #define E2END (0x1FF)
 
 #endif
@@ -26,5 +26,6 @@
 #define __PGMSPACE_H__
 
 extern uint8_t pgm_read_byte(uint16_t);
+extern uint16_t pgm_read_word(uint16_t);
 
 #endif
@@ -26,8 +26,11 @@
 
 // AVR watchdog timer functions for unit test stubs
 
+unsigned int wdt_reset_count;  // watchdog resets, for timing the main loop
+
 void wdt_reset(void)
 {
+    ++wdt_reset_count;
 }
 
 void wdt_disable(void)
@@ -25,10 +25,14 @@
 #ifndef __WDT_H__
 #define __WDT_H__
 
+#define WDTO_15MS 15
 #define WDTO_1S 1000
 
 extern void wdt_disable(void);
 extern void wdt_reset(void);
 extern void wdt_enable(uint16_t);
 
+// access to internal variables for testing
+extern unsigned int wdt_reset_count;
+
 #endif
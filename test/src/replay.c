@@ -0,0 +1,343 @@
+/******************************************************************************
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright 2021 Joseph Kroesche
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *****************************************************************************/
+
+// Replay a CAN bus log through the host build of the boot loader.
+//
+// This is not a unit test. It reads a candump log of a real session, such as
+// a capture with `candump -l` or a `canloader.py --trace` file, and feeds the
+// commands for one board through the CAN register stubs, the same way as the
+// main loop: receive_message(), process_message() and send_message(). The
+// REPORTs it produces are compared with the REPORTs in the log, and at the
+// end the app EEPROM metadata and flash image are shown.
+//
+// usage: bootloader_replay [-b boardid] [-i idbase] [-o image.bin] logfile
+//
+// The board ID is taken from the first command in the log if it is not
+// given. The CAN ID base is the default one unless -i gives another. The
+// flash is erased and the EEPROM is blank at the start.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "avr/io.h"
+#include "avr/pgmspace.h"
+
+#include "main.c"
+
+#define FLASH_SIZE (FLASHEND + 1)
+
+// REPORTs produced, waiting to be compared with the REPORTs in the log
+#define RPT_QUEUE_LEN 16
+
+// the replay reads back from the simulated flash
+uint8_t pgm_read_byte(uint16_t addr)
+{
+    return ((uint8_t *)flashmem)[addr];
+}
+
+uint16_t pgm_read_word(uint16_t addr)
+{
+    return pgm_read_byte(addr) + (pgm_read_byte(addr + 1) << 8);
+}
+
+// one frame of the log
+struct frame {
+    double time;
+    uint32_t id;
+    uint8_t len;
+    uint8_t data[8];
+};
+
+// parse a candump log line like "(1.000000) can0 1B007113#0102030405060708"
+// returns false for other lines, and for remote and CAN FD frames
+static bool parse_frame(const char *line, struct frame *pf)
+{
+    char iface[32];
+    char idstr[16];
+    if ((sscanf(line, " (%lf) %31s %15[0-9A-Fa-f]", &pf->time, iface, idstr) < 3)
+     || (strchr(line, '#') == NULL)) {
+        return false;
+    }
+    const char *p = strchr(line, '#') + 1;
+    if ((*p == '#') || (*p == 'R')) {
+        return false;
+    }
+    pf->id = strtoul(idstr, NULL, 16);
+
+    pf->len = 0;
+    while ((pf->len < 8) && (sscanf(p, "%2hhx", &pf->data[pf->len]) == 1)) {
+        ++pf->len;
+        p += 2;
+    }
+    return true;
+}
+
+// put a received frame in the receive MOB registers
+static void load_rx_mob(const struct frame *pf)
+{
+    reset_all();
+    CANSTMOB_reg8.data[0] = _BV(RXOK);
+    CANCDMOB_reg8.data[0] = pf->len;
+    CANIDT1_reg8.data[0] = (uint8_t)(pf->id >> 21);
+    CANIDT2_reg8.data[0] = (uint8_t)(pf->id >> 13);
+    CANIDT3_reg8.data[0] = (uint8_t)(pf->id >> 5);
+    CANIDT4_reg8.data[0] = (uint8_t)(pf->id << IDT0);
+    memcpy(CANMSG_reg8.data, pf->data, pf->len);
+}
+
+// send the REPORT in rptbuf, and get it back out of the transmit registers
+static void send_report(struct frame *prpt)
+{
+    // send_message() polls CANSTMOB for TXOK after one other access
+    reset_all();
+    CANSTMOB_reg8.data[1] = _BV(TXOK);
+    send_message(8, rptbuf);
+    prpt->id = ((uint32_t)CANIDT1_reg8.data[0] << 21)
+             | ((uint32_t)CANIDT2_reg8.data[0] << 13)
+             | ((uint32_t)CANIDT3_reg8.data[0] << 5)
+             | (CANIDT4_reg8.data[0] >> IDT0);
+    prpt->len = 8;
+    memcpy(prpt->data, CANMSG_reg8.data, 8);
+}
+
+static void print_frame(const char *iface, const struct frame *pf)
+{
+    printf("(%.6f) %s %08lX#", pf->time, iface, (unsigned long)pf->id);
+    for (uint8_t i = 0; i < pf->len; ++i) {
+        printf("%02X", pf->data[i]);
+    }
+}
+
+// REPORTs produced by the replay that have not been matched with the log yet
+struct rpt_queue {
+    struct frame rpt[RPT_QUEUE_LEN];
+    unsigned int head;
+    unsigned int count;
+    uint8_t rxofs;          // log receive counter - replay receive counter
+    unsigned int unlogged;  // REPORTs that are not in the log
+};
+
+// get the REPORT n places from the head of the queue
+static struct frame *rpt_at(struct rpt_queue *pq, unsigned int n)
+{
+    return &pq->rpt[(pq->head + n) % RPT_QUEUE_LEN];
+}
+
+// remove the first n REPORTs, which the log does not have
+static void rpt_drop(struct rpt_queue *pq, unsigned int n)
+{
+    for (unsigned int i = 0; i < n; ++i) {
+        printf("not in log: ");
+        print_frame("replay", rpt_at(pq, 0));
+        printf("\n");
+        pq->head = (pq->head + 1) % RPT_QUEUE_LEN;
+        --pq->count;
+        ++pq->unlogged;
+    }
+}
+
+// find the REPORT that answers the same command as a REPORT of the log
+// The receive counter in byte 7 tells which command a REPORT is for. The log
+// may start with a counter that is not 0, so the first REPORT with the same
+// type and data sets the offset between the counters. The REPORTs before the
+// one that is found are not in the log, and are dropped.
+// returns the REPORT, or NULL if there is none
+static struct frame *rpt_match(struct rpt_queue *pq, const struct frame *pf)
+{
+    for (unsigned int i = 0; i < pq->count; ++i) {
+        struct frame *prpt = rpt_at(pq, i);
+        if ((uint8_t)(prpt->data[7] + pq->rxofs) == pf->data[7]) {
+            rpt_drop(pq, i);
+            return prpt;
+        }
+    }
+    for (unsigned int i = 0; i < pq->count; ++i) {
+        struct frame *prpt = rpt_at(pq, i);
+        if (!memcmp(&prpt->data[4], &pf->data[4], 3)) {
+            pq->rxofs = pf->data[7] - prpt->data[7];
+            rpt_drop(pq, i);
+            return prpt;
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, const char *argv[])
+{
+    const char *logname = NULL;
+    const char *imgname = NULL;
+    const char *basename = NULL;
+    int board = -1;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-b") && (i + 1 < argc)) {
+            board = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-i") && (i + 1 < argc)) {
+            basename = argv[++i];
+        } else if (!strcmp(argv[i], "-o") && (i + 1 < argc)) {
+            imgname = argv[++i];
+        } else {
+            logname = argv[i];
+        }
+    }
+    if (logname == NULL) {
+        fprintf(stderr, "usage: %s [-b boardid] [-i idbase] [-o image.bin] logfile\n",
+                argv[0]);
+        return 2;
+    }
+    FILE *logfile = fopen(logname, "r");
+    if (logfile == NULL) {
+        perror(logname);
+        return 2;
+    }
+
+    // a blank part, with the CAN ID config from the (blank) EEPROM, or the
+    // ID base that was given
+    flash_reset();
+    eep_reset();
+#if CONFIG_CAN_IDCFG
+    can_config_load();
+    if (basename != NULL) {
+        can_id_base = strtoul(basename, NULL, 16) & 0x1FFFFF00UL;
+    }
+#else
+    if (basename != NULL) {
+        fprintf(stderr, "-i needs a build with CONFIG_CAN_IDCFG\n");
+        fclose(logfile);
+        return 2;
+    }
+#endif
+
+    struct rpt_queue rptq = { .count = 0 };
+    unsigned int commands = 0;
+    unsigned int skipped = 0;
+    unsigned int matched = 0;
+    unsigned int differ = 0;
+    bool app_running = false;
+
+    char line[128];
+    struct frame fr;
+    while (fgets(line, sizeof(line), logfile)) {
+        if (!parse_frame(line, &fr)) {
+            continue;
+        }
+        uint8_t frboard = (fr.id >> 4) & 0x0F;
+        if ((fr.id & 0x1FFFFF00UL) != CAN_ID_BASE) {
+            continue;   // not a boot loader message
+        }
+        if (board < 0) {
+            board = frboard;
+        }
+        if (frboard != board) {
+            continue;
+        }
+        boardid = board;
+
+        if ((fr.id & 0x0F) == CMD_REPORT) {
+            // an ANNOUNCE means the target started again
+            if ((fr.len == 8) && (fr.data[4] == RPT_ANNOUNCE)) {
+                app_running = false;
+                run_app = 0;
+                rxcount = 0;
+                rptq.rxofs = 0;
+                continue;
+            }
+            // compare the type and data with the REPORT from the replay for
+            // the same command. The version can be different.
+            struct frame *prpt = (fr.len == 8) ? rpt_match(&rptq, &fr) : NULL;
+            if ((prpt != NULL) && !memcmp(&prpt->data[4], &fr.data[4], 3)) {
+                ++matched;
+            } else {
+                ++differ;
+                printf("differs: ");
+                print_frame("log", &fr);
+                printf("\n");
+            }
+            if (prpt != NULL) {
+                rptq.head = (rptq.head + 1) % RPT_QUEUE_LEN;
+                --rptq.count;
+            }
+            continue;
+        }
+
+        // the boot loader does not see anything while the app is running
+        if (app_running) {
+            ++skipped;
+            continue;
+        }
+
+        // the same steps as the main loop
+        load_rx_mob(&fr);
+        if (receive_message() != MSG_READY) {
+            continue;
+        }
+        ++commands;
+        process_message();
+        if (rptq.count == RPT_QUEUE_LEN) {
+            rpt_drop(&rptq, 1);     // the oldest was never in the log
+        }
+        struct frame *prpt = rpt_at(&rptq, rptq.count);
+        send_report(prpt);
+        prpt->time = fr.time;
+        print_frame("replay", prpt);
+        printf("\n");
+        ++rptq.count;
+        if (run_app) {
+            app_running = true;
+        }
+    }
+    fclose(logfile);
+    rpt_drop(&rptq, rptq.count);
+
+    uint16_t applen = eeprom_read_word(EEP_APP_LEN);
+    uint16_t appcrc = eeprom_read_word(EEP_APP_CRC);
+    uint16_t apptag = eeprom_read_word(EEP_APP_TAG);
+    printf("board %d: %u commands, %u skipped while the app ran\n", board,
+           commands, skipped);
+    if (commands == 0) {
+        printf("no commands with CAN ID base %08lX, use -i for another base\n",
+               (unsigned long)CAN_ID_BASE);
+    }
+    printf("reports: %u match the log, %u differ, %u not in the log\n",
+           matched, differ, rptq.unlogged);
+    printf("app: len %04X crc %04X tag %04X, %s\n", applen, appcrc, apptag,
+           app_is_valid() ? "valid" : "not valid");
+
+    if ((imgname != NULL) && (applen > FLASH_SIZE)) {
+        printf("flash: no app image in the EEPROM, %s not written\n", imgname);
+    } else if (imgname != NULL) {
+        FILE *imgfile = fopen(imgname, "wb");
+        if (imgfile == NULL) {
+            perror(imgname);
+            return 2;
+        }
+        fwrite(flashmem, 1, applen, imgfile);
+        fclose(imgfile);
+        printf("flash: %u bytes written to %s\n", applen, imgname);
+    }
+
+    return differ ? 1 : 0;
+}
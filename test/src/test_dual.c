@@ -0,0 +1,243 @@
+/******************************************************************************
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright 2021 Joseph Kroesche
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *****************************************************************************/
+
+
+// Unit tests for the dual slot (staged update) build of the boot loader.
+// This is built as a separate test program because it needs a different
+// build configuration than the main tests.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "unity_fixture.h"
+#include "libcrc/checksum.h"
+
+#include "avr/io.h"
+#include "avr/pgmspace.h"
+
+#define CONFIG_DUAL_SLOT 1
+#include "main.c"
+
+#define FLASH_SIZE (FLASHEND + 1)
+
+// the dual slot test reads back from the simulated flash
+uint8_t pgm_read_byte(uint16_t addr)
+{
+    return ((uint8_t *)flashmem)[addr];
+}
+
+uint16_t pgm_read_word(uint16_t addr)
+{
+    return pgm_read_byte(addr) + (pgm_read_byte(addr + 1) << 8);
+}
+
+/*****************************************************************************/
+
+TEST_GROUP(dual_slot);
+
+static uint8_t old_image[512];
+static uint8_t new_image[512];
+static uint16_t test_crc;
+
+// create a fake image based on random seed
+static void create_image(uint8_t *img, unsigned seed, unsigned len)
+{
+    srand(seed);
+    for (unsigned i = 0; i < len; ++i) {
+        img[i] = (uint8_t)rand();
+    }
+}
+
+static uint16_t buf_crc(const uint8_t *img, unsigned len)
+{
+    uint16_t crc = 0;
+    for (unsigned i = 0; i < len; ++i) {
+        crc = update_crc_16(crc, img[i]);
+    }
+    return crc;
+}
+
+// put an image directly in the simulated flash and eeprom, as if it had
+// been loaded before
+static void install_image(const uint8_t *img, uint16_t len)
+{
+    memcpy(flashmem, img, len);
+    eeprom_update_word(EEP_APP_LEN, len);
+    eeprom_update_word(EEP_APP_CRC, buf_crc(img, len));
+}
+
+// send a message with the payload to process_message
+static void send_cmd(uint8_t cmd, const uint8_t *payload, uint8_t len)
+{
+    cmdid = cmd;
+    msglen = len;
+    memset(msgbuf, 0, 8);
+    memcpy(msgbuf, payload, len);
+    process_message();
+}
+
+// load an image with START and DATA, but no STOP
+static void load_image(const uint8_t *img, uint16_t len)
+{
+    uint8_t lenbuf[2] = { (uint8_t)len, (uint8_t)(len >> 8) };
+    send_cmd(2, lenbuf, 2);
+    TEST_ASSERT_EQUAL_UINT8(1, rptbuf[4]);  // READY
+    test_crc = 0;
+    for (uint16_t idx = 0; idx < len; idx += 8) {
+        send_cmd(3, &img[idx], 8);
+        for (uint16_t i = idx; (i < idx + 8) && (i < len); ++i) {
+            test_crc = update_crc_16(test_crc, img[i]);
+        }
+    }
+    TEST_ASSERT_EQUAL_UINT8(2, rptbuf[4]);  // END
+}
+
+static void send_stop(uint16_t crc)
+{
+    uint8_t crcbuf[2] = { (uint8_t)crc, (uint8_t)(crc >> 8) };
+    send_cmd(4, crcbuf, 2);
+    TEST_ASSERT_EQUAL_UINT8(3, rptbuf[4]);  // DONE
+}
+
+TEST_SETUP(dual_slot)
+{
+    flash_reset();
+    eep_reset();
+    app_check = APP_UNCHECKED;
+    create_image(old_image, 1, sizeof(old_image));
+    create_image(new_image, 2, sizeof(new_image));
+    install_image(old_image, 300);
+}
+
+TEST_TEAR_DOWN(dual_slot)
+{
+}
+
+TEST(dual_slot, load_to_stage)
+{
+    load_image(new_image, 400);
+
+    // the new image is in the staging slot and the app is not changed
+    uint8_t *flashmem8 = (uint8_t *)flashmem;
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(new_image, &flashmem8[STAGE_ADDR], 400);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(old_image, flashmem8, 300);
+    TEST_ASSERT_TRUE(app_is_valid());
+
+    // good STOP copies the new image over the app
+    send_stop(test_crc);
+    TEST_ASSERT_EQUAL_UINT8(1, rptbuf[5]);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(new_image, flashmem8, 400);
+    TEST_ASSERT_EQUAL_UINT16(400, eeprom_read_word(EEP_APP_LEN));
+    TEST_ASSERT_EQUAL_UINT16(test_crc, eeprom_read_word(EEP_APP_CRC));
+    TEST_ASSERT_EQUAL_UINT8(JRNL_IDLE, eeprom_read_byte(EEP_JRNL_STATE));
+    TEST_ASSERT_TRUE(app_is_valid());
+}
+
+TEST(dual_slot, stop_bad)
+{
+    load_image(new_image, 400);
+    send_stop(test_crc + 1);
+    TEST_ASSERT_EQUAL_UINT8(0, rptbuf[5]);
+
+    // the old app is still there and still valid
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(old_image, flashmem, 300);
+    TEST_ASSERT_EQUAL_UINT16(300, eeprom_read_word(EEP_APP_LEN));
+    TEST_ASSERT_EQUAL_UINT8(JRNL_IDLE, eeprom_read_byte(EEP_JRNL_STATE));
+    TEST_ASSERT_TRUE(app_is_valid());
+}
+
+TEST(dual_slot, too_big)
+{
+    uint8_t lenbuf[2] = { (uint8_t)(SLOT_SIZE + 8), (uint8_t)((SLOT_SIZE + 8) >> 8) };
+    send_cmd(2, lenbuf, 2);
+    TEST_ASSERT_EQUAL_UINT8(5, rptbuf[4]);  // ERR
+    // no DATA is accepted
+    send_cmd(3, new_image, 8);
+    TEST_ASSERT_EQUAL_UINT8(5, rptbuf[4]);
+}
+
+TEST(dual_slot, resume_copy)
+{
+    // a verified image in the staging slot, and the copy was interrupted
+    // after the first page
+    uint8_t *flashmem8 = (uint8_t *)flashmem;
+    memcpy(&flashmem8[STAGE_ADDR], new_image, 400);
+    memcpy(flashmem8, new_image, SPM_PAGESIZE);
+    eeprom_update_word(EEP_JRNL_LEN, 400);
+    eeprom_update_word(EEP_JRNL_CRC, buf_crc(new_image, 400));
+    eeprom_update_word(EEP_JRNL_TAG, 0x1234);
+    eeprom_update_byte(EEP_JRNL_PAGE, 1);
+    eeprom_update_byte(EEP_JRNL_STATE, JRNL_COPY);
+    app_check = APP_UNCHECKED;  // there was a reset during the copy
+    // the app is not valid until the copy is finished
+    TEST_ASSERT_FALSE(app_is_valid());
+
+    slot_resume();
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(new_image, flashmem8, 400);
+    TEST_ASSERT_EQUAL_UINT16(400, eeprom_read_word(EEP_APP_LEN));
+    TEST_ASSERT_EQUAL_UINT16(0x1234, eeprom_read_word(EEP_APP_TAG));
+    TEST_ASSERT_EQUAL_UINT8(4, eeprom_read_byte(EEP_JRNL_PAGE));
+    TEST_ASSERT_EQUAL_UINT8(JRNL_IDLE, eeprom_read_byte(EEP_JRNL_STATE));
+    TEST_ASSERT_TRUE(app_is_valid());
+}
+
+TEST(dual_slot, resume_bad_stage)
+{
+    // journal set by the app, but the staging slot does not match it
+    uint8_t *flashmem8 = (uint8_t *)flashmem;
+    memcpy(&flashmem8[STAGE_ADDR], new_image, 400);
+    flashmem8[STAGE_ADDR + 200] ^= 1;
+    eeprom_update_word(EEP_JRNL_LEN, 400);
+    eeprom_update_word(EEP_JRNL_CRC, buf_crc(new_image, 400));
+    eeprom_update_byte(EEP_JRNL_PAGE, 0);
+    eeprom_update_byte(EEP_JRNL_STATE, JRNL_COPY);
+
+    slot_resume();
+    // the old app is left in place and the journal is cleared
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(old_image, flashmem8, 300);
+    TEST_ASSERT_EQUAL_UINT8(JRNL_IDLE, eeprom_read_byte(EEP_JRNL_STATE));
+    TEST_ASSERT_TRUE(app_is_valid());
+}
+
+TEST_GROUP_RUNNER(dual_slot)
+{
+    RUN_TEST_CASE(dual_slot, load_to_stage);
+    RUN_TEST_CASE(dual_slot, stop_bad);
+    RUN_TEST_CASE(dual_slot, too_big);
+    RUN_TEST_CASE(dual_slot, resume_copy);
+    RUN_TEST_CASE(dual_slot, resume_bad_stage);
+}
+
+static void runner(void)
+{
+    RUN_TEST_GROUP(dual_slot);
+}
+
+int main(int argc, const char *argv[])
+{
+    return UnityMain(argc, argv, runner);
+}
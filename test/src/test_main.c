@@ -22,6 +22,7 @@
  * IN THE SOFTWARE.
  *****************************************************************************/
 
+#include <setjmp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -35,6 +36,7 @@
 #include "avr/pgmspace.h"
 
 #include "main.c"
+#include "canboot_app.h"
 
 #define FLASH_SIZE (FLASHEND + 1)
 
@@ -45,10 +47,11 @@ TEST_GROUP(send_message);
 TEST_SETUP(send_message)
 {
     reset_all();
-    // send_message() polls on CANSTMOB zero. CANSTMOB is accessed
-    // once before the poll so need to use index 1 for the non-zero
+    // send_message() polls on CANSTMOB for TXOK. CANSTMOB is accessed
+    // once before the poll so need to use index 1 for the TXOK
     // to keep send_message() from hanging in a poll loop
-    CANSTMOB_reg8.data[1] = 1;
+    CANSTMOB_reg8.data[1] = _BV(TXOK);
+    ovr_first = false;
 }
 
 TEST_TEAR_DOWN(send_message)
@@ -63,9 +66,338 @@ TEST(send_message, nominal_send)
     TEST_ASSERT_EQUAL_UINT8_ARRAY(msg, CANMSG_reg8.data, 8);
 }
 
+TEST(send_message, can_send_id)
+{
+    uint8_t msg[2] = { 0xA5, 0x5A };
+    can_send(3, 0x12345678UL, 2, msg);
+    // 29-bit ID packed into the ID tag registers
+    TEST_ASSERT_EQUAL_HEX8(0x91, CANIDT1_reg8.data[0]);
+    TEST_ASSERT_EQUAL_HEX8(0xA2, CANIDT2_reg8.data[0]);
+    TEST_ASSERT_EQUAL_HEX8(0xB3, CANIDT3_reg8.data[0]);
+    TEST_ASSERT_EQUAL_HEX8(0xC0, CANIDT4_reg8.data[0]);
+    // DLC and transmit enable, then disabled after sending
+    TEST_ASSERT_EQUAL_HEX8(_BV(CONMOB0) | _BV(IDE) | 2, CANCDMOB_reg8.data[0]);
+    TEST_ASSERT_EQUAL_HEX8(0, CANCDMOB_reg8.data[1]);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(msg, CANMSG_reg8.data, 2);
+}
+
+TEST(send_message, tx_errors)
+{
+    uint8_t msg[8] = { 0 };
+    // one error, then the retry is sent
+    CANSTMOB_reg8.data[1] = _BV(AERR);
+    CANSTMOB_reg8.data[3] = 0;
+    CANSTMOB_reg8.data[4] = _BV(TXOK);
+    tx_errors = 0;
+    send_message(8, msg);
+    TEST_ASSERT_EQUAL_UINT16(1, tx_errors);
+    // only the error flags were cleared
+    TEST_ASSERT_EQUAL_HEX8(0xE0, CANSTMOB_reg8.data[2]);
+
+    // bus-off gives up
+    reset_all();
+    CANGSTA_reg8.data[0] = _BV(BOFF);
+    TEST_ASSERT_EQUAL_HEX8(CANBOOT_TX_FAIL, can_send(0, 0, 8, msg));
+
+    // too many errors gives up
+    reset_all();
+    memset(CANSTMOB_reg8.data, _BV(BERR), sizeof(CANSTMOB_reg8.data));
+    TEST_ASSERT_EQUAL_HEX8(CANBOOT_TX_FAIL | CAN_TX_RETRIES,
+                           can_send(0, 0, 8, msg));
+}
+
+TEST(send_message, rx_overrun)
+{
+    // nothing in the receive MOB, message in the overrun MOB
+    CANSTMOB_reg8.data[0] = 0;
+    CANSTMOB_reg8.data[1] = _BV(RXOK);
+    CANCDMOB_reg8.data[0] = 2;
+    CANIDT4_reg8.data[0] = 3 << IDT0;   // command 3
+    CANMSG_reg8.data[0] = 0x55;
+    rx_overruns = 0;
+    TEST_ASSERT_EQUAL(MSG_READY, receive_message());
+    TEST_ASSERT_EQUAL_UINT8(3, cmdid);
+    TEST_ASSERT_EQUAL_UINT8(2, msglen);
+    TEST_ASSERT_EQUAL_UINT8(0x55, msgbuf[0]);
+    TEST_ASSERT_EQUAL_UINT16(1, rx_overruns);
+
+    // no messages
+    reset_all();
+    TEST_ASSERT_EQUAL(MSG_NONE, receive_message());
+    TEST_ASSERT_EQUAL_UINT16(1, rx_overruns);
+}
+
+TEST(send_message, rx_order)
+{
+    // A in the receive MOB, B in the overrun MOB. CANSTMOB is read, then
+    // cleared by each receive, and the overrun MOB is checked after the
+    // receive MOB.
+    CANSTMOB_reg8.data[0] = _BV(RXOK);  // receive MOB has A
+    CANSTMOB_reg8.data[2] = _BV(RXOK);  // overrun MOB has B
+    CANSTMOB_reg8.data[3] = _BV(RXOK);  // B is read from the overrun MOB
+    CANSTMOB_reg8.data[5] = _BV(RXOK);  // receive MOB has C
+    CANCDMOB_reg8.data[0] = 1;
+    CANCDMOB_reg8.data[2] = 1;
+    CANCDMOB_reg8.data[4] = 1;
+    CANIDT4_reg8.data[0] = 3 << IDT0;
+    CANIDT4_reg8.data[1] = 3 << IDT0;
+    CANIDT4_reg8.data[2] = 3 << IDT0;
+    CANMSG_reg8.data[0] = 0xA1;
+    CANMSG_reg8.data[1] = 0xB2;
+    CANMSG_reg8.data[2] = 0xC3;
+    rx_overruns = 0;
+
+    TEST_ASSERT_EQUAL(MSG_READY, receive_message());
+    TEST_ASSERT_EQUAL_UINT8(0xA1, msgbuf[0]);
+    TEST_ASSERT_EQUAL_UINT16(0, rx_overruns);
+
+    // B is next, even though the receive MOB may have C by now
+    TEST_ASSERT_EQUAL(MSG_READY, receive_message());
+    TEST_ASSERT_EQUAL_UINT8(0xB2, msgbuf[0]);
+    TEST_ASSERT_EQUAL_UINT16(1, rx_overruns);
+
+    TEST_ASSERT_EQUAL(MSG_READY, receive_message());
+    TEST_ASSERT_EQUAL_UINT8(0xC3, msgbuf[0]);
+    TEST_ASSERT_EQUAL_UINT16(1, rx_overruns);
+    TEST_ASSERT_EQUAL(MSG_NONE, receive_message());
+}
+
+TEST(send_message, busoff)
+{
+    busoff_count = 0;
+    can_check_busoff();
+    TEST_ASSERT_EQUAL_UINT16(0, busoff_count);
+    TEST_ASSERT_EQUAL_UINT(0, CANGCON_reg8.idx);
+
+    // bus-off restarts the CAN controller
+    CANGIT_reg8.data[1] = _BV(BOFFIT);
+    can_check_busoff();
+    TEST_ASSERT_EQUAL_UINT16(1, busoff_count);
+    TEST_ASSERT_EQUAL_HEX8(_BV(SWRES), CANGCON_reg8.data[0]);
+    TEST_ASSERT_EQUAL_HEX8(_BV(ENASTB), CANGCON_reg8.data[1]);
+}
+
+TEST(send_message, can_receive)
+{
+    uint32_t id = 0;
+    uint8_t buf[8];
+
+    // nothing received
+    TEST_ASSERT_EQUAL_UINT8(CANBOOT_NO_MSG, can_receive(2, &id, buf));
+
+    reset_all();
+    CANSTMOB_reg8.data[0] = _BV(RXOK);
+    CANCDMOB_reg8.data[0] = 3;
+    CANIDT1_reg8.data[0] = 0x91;
+    CANIDT2_reg8.data[0] = 0xA2;
+    CANIDT3_reg8.data[0] = 0xB3;
+    CANIDT4_reg8.data[0] = 0xC0;
+    CANMSG_reg8.data[0] = 7;
+    CANMSG_reg8.data[1] = 8;
+    CANMSG_reg8.data[2] = 9;
+    TEST_ASSERT_EQUAL_UINT8(3, can_receive(2, &id, buf));
+    TEST_ASSERT_EQUAL_HEX32(0x12345678UL, id);
+    TEST_ASSERT_EQUAL_UINT8(7, buf[0]);
+    TEST_ASSERT_EQUAL_UINT8(9, buf[2]);
+    // receiver is enabled again
+    TEST_ASSERT_EQUAL_HEX8(_BV(CONMOB1) | _BV(IDE) | 8, CANCDMOB_reg8.data[1]);
+}
+
+TEST(send_message, flash_write_page)
+{
+    uint8_t page[SPM_PAGESIZE];
+    for (unsigned i = 0; i < SPM_PAGESIZE; ++i) {
+        page[i] = (uint8_t)(i * 3);
+    }
+    flash_reset();
+    // second page of flash
+    TEST_ASSERT_EQUAL_UINT8(0, flash_write_page(SPM_PAGESIZE, page));
+    uint8_t *flashmem8 = (uint8_t *)flashmem;
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(page, &flashmem8[SPM_PAGESIZE], SPM_PAGESIZE);
+    TEST_ASSERT_EACH_EQUAL_UINT8(0xff, flashmem8, SPM_PAGESIZE);
+    TEST_ASSERT_TRUE(flash_rww_enabled);
+
+    // not allowed in the boot section, or not at the start of a page
+    flash_reset();
+    TEST_ASSERT_EQUAL_UINT8(1, flash_write_page(BOOT_START, page));
+    TEST_ASSERT_EQUAL_UINT8(1, flash_write_page(SPM_PAGESIZE + 2, page));
+    TEST_ASSERT_EACH_EQUAL_UINT8(0xff, flashmem8, FLASH_SIZE);
+}
+
 TEST_GROUP_RUNNER(send_message)
 {
     RUN_TEST_CASE(send_message, nominal_send);
+    RUN_TEST_CASE(send_message, can_send_id);
+    RUN_TEST_CASE(send_message, can_receive);
+    RUN_TEST_CASE(send_message, flash_write_page);
+    RUN_TEST_CASE(send_message, tx_errors);
+    RUN_TEST_CASE(send_message, rx_overrun);
+    RUN_TEST_CASE(send_message, rx_order);
+    RUN_TEST_CASE(send_message, busoff);
+}
+
+/*****************************************************************************/
+
+TEST_GROUP(device_init);
+
+TEST_SETUP(device_init)
+{
+    reset_all();
+    eep_reset();
+    app_check = APP_UNCHECKED;
+    // device_init() sends a report at the end, so CANSTMOB has to read as
+    // TXOK to keep send_message() from hanging in a poll loop
+    memset(CANSTMOB_reg8.data, _BV(TXOK), sizeof(CANSTMOB_reg8.data));
+}
+
+TEST_TEAR_DOWN(device_init)
+{
+}
+
+TEST(device_init, announce)
+{
+    reset_cause = _BV(WDRF);
+    TCNT1_reg16 = 1234;
+    device_init();
+    // announce report was sent
+    TEST_ASSERT_EQUAL(8, CANMSG_reg8.idx);
+    TEST_ASSERT_EQUAL_UINT8(99, CANMSG_reg8.data[0]);   // version
+    TEST_ASSERT_EQUAL_UINT8(6, CANMSG_reg8.data[4]);    // type ANNOUNCE
+    TEST_ASSERT_EQUAL_UINT8(0, CANMSG_reg8.data[5]);    // no valid app
+    TEST_ASSERT_EQUAL_UINT8(_BV(WDRF), CANMSG_reg8.data[6]);
+    // boot timing
+    TEST_ASSERT_EQUAL_UINT16(1234, bootshare.t_init);
+    // computed CAN bit timing for 8 MHz, 250 kbit/s matches the data sheet
+    TEST_ASSERT_EQUAL_HEX8(0x06, CANBT1_reg8.data[0]);
+    TEST_ASSERT_EQUAL_HEX8(0x04, CANBT2_reg8.data[0]);
+    TEST_ASSERT_EQUAL_HEX8(0x13, CANBT3_reg8.data[0]);
+}
+
+TEST(device_init, can_id_config)
+{
+    // no config, the defaults are used
+    device_init();
+    TEST_ASSERT_EQUAL_HEX32(CANBOOT_CANID, can_id_base);
+    TEST_ASSERT_EQUAL_HEX32(CANBOOT_CANIDMASK, can_id_mask);
+
+    // the low byte of the base is ignored, and the board ID always matches
+    canboot_set_can_id(0x000123AAUL, 0x0001FF00UL);
+    reset_all();
+    memset(CANSTMOB_reg8.data, _BV(TXOK), sizeof(CANSTMOB_reg8.data));
+    device_init();
+    TEST_ASSERT_EQUAL_HEX32(0x00012300UL, can_id_base);
+    TEST_ASSERT_EQUAL_HEX32(0x0001FFF0UL, can_id_mask);
+    // announce from board 15 is sent with the new base, 0x000123F5
+    TEST_ASSERT_EQUAL_HEX8(0x09, CANIDT2_reg8.data[2]);
+    TEST_ASSERT_EQUAL_HEX8(0xA8, CANIDT4_reg8.data[2]);
+
+    // bad CRC, back to the defaults
+    eepmem[E2END - 24] ^= 1;
+    device_init();
+    TEST_ASSERT_EQUAL_HEX32(CANBOOT_CANID, can_id_base);
+    TEST_ASSERT_EQUAL_HEX32(CANBOOT_CANIDMASK, can_id_mask);
+}
+
+TEST_GROUP_RUNNER(device_init)
+{
+    RUN_TEST_CASE(device_init, announce);
+    RUN_TEST_CASE(device_init, can_id_config);
+}
+
+/*****************************************************************************/
+
+TEST_GROUP(reset_cause);
+
+TEST_SETUP(reset_cause)
+{
+    reset_all();
+    reset_cause = 0;
+}
+
+TEST_TEAR_DOWN(reset_cause)
+{
+}
+
+TEST(reset_cause, power_on)
+{
+    MCUSR_reg8.data[0] = _BV(PORF);
+    bootshare.request = 0;
+    get_reset_cause();
+    TEST_ASSERT_EQUAL_UINT8(_BV(PORF), reset_cause);
+    TEST_ASSERT_EQUAL_UINT8(0, MCUSR_reg8.data[1]);     // MCUSR cleared
+}
+
+TEST(reset_cause, boot_timing)
+{
+    // leftover values from a previous boot
+    bootshare.t_init = 1;
+    bootshare.t_window = 2;
+    bootshare.t_crc = 3;
+    bootshare.t_jump = 4;
+    MCUSR_reg8.data[0] = _BV(WDRF);
+    get_reset_cause();
+    // timer was started and timing cleared for this boot
+    TEST_ASSERT_EQUAL_UINT8(_BV(CS12) | _BV(CS10), TCCR1B_reg8.data[0]);
+    TEST_ASSERT_EQUAL_UINT16(0, bootshare.t_init);
+    TEST_ASSERT_EQUAL_UINT16(0, bootshare.t_window);
+    TEST_ASSERT_EQUAL_UINT16(0, bootshare.t_crc);
+    TEST_ASSERT_EQUAL_UINT16(0, bootshare.t_jump);
+    TEST_ASSERT_EQUAL_UINT8(128, bootshare.tick_us);   // 8 MHz
+    TEST_ASSERT_EQUAL_UINT8(_BV(WDRF), bootshare.reset_cause);
+}
+
+TEST(reset_cause, app_request)
+{
+    // app left the magic value before resetting
+    MCUSR_reg8.data[0] = _BV(PORF);
+    bootshare.request = CANBOOT_REQUEST_MAGIC;
+    get_reset_cause();
+    TEST_ASSERT_EQUAL_UINT8(_BV(PORF) | _BV(BOOTREQF), reset_cause);
+    // request is consumed
+    TEST_ASSERT_EQUAL_UINT16(0, bootshare.request);
+}
+
+TEST(reset_cause, bad_request)
+{
+    // random RAM contents after power up are not a request
+    MCUSR_reg8.data[0] = _BV(PORF);
+    bootshare.request = CANBOOT_REQUEST_MAGIC ^ 0x0100;
+    get_reset_cause();
+    TEST_ASSERT_EQUAL_UINT8(_BV(PORF), reset_cause);
+    TEST_ASSERT_EQUAL_UINT16(0, bootshare.request);
+}
+
+TEST(reset_cause, stats)
+{
+    stats_clear();
+    stats[STAT_FRAMES] = 5;
+    stats_seal();
+
+    // kept over a watchdog reset
+    reset_cause = _BV(WDRF);
+    stats_start();
+    TEST_ASSERT_EQUAL_UINT16(5, stats[STAT_FRAMES]);
+
+    // cleared if the check word does not match
+    stats[STAT_FRAMES] = 6;
+    stats_start();
+    TEST_ASSERT_EQUAL_UINT16(0, stats[STAT_FRAMES]);
+
+    // cleared at power on
+    stats[STAT_FRAMES] = 7;
+    stats_seal();
+    reset_cause = _BV(PORF);
+    stats_start();
+    TEST_ASSERT_EQUAL_UINT16(0, stats[STAT_FRAMES]);
+}
+
+TEST_GROUP_RUNNER(reset_cause)
+{
+    RUN_TEST_CASE(reset_cause, power_on);
+    RUN_TEST_CASE(reset_cause, boot_timing);
+    RUN_TEST_CASE(reset_cause, app_request);
+    RUN_TEST_CASE(reset_cause, bad_request);
+    RUN_TEST_CASE(reset_cause, stats);
 }
 
 /*****************************************************************************/
@@ -76,16 +408,25 @@ static uint8_t saved_rxcount;
 static uint16_t test_crc;
 static uint16_t membufidx;
 static uint8_t test_image[FLASH_SIZE];
+static unsigned int pgm_reads;  // bytes read by the app CRC
 
 uint8_t pgm_read_byte(uint16_t addr)
 {
+    ++pgm_reads;
     return test_image[addr];
 }
 
+// the page compare of a load reads the flash as it is before the write
+uint16_t pgm_read_word(uint16_t addr)
+{
+    return flashmem[addr / 2];
+}
+
 TEST_SETUP(process_message)
 {
     // process_message() does not use any registers
     saved_rxcount = rxcount;    // for verify rx counter is functioning
+    app_check = APP_UNCHECKED;  // tests change the flash directly
     // reset rx message variables state
     msglen = 0;
     cmdid = 0;
@@ -117,6 +458,32 @@ TEST(process_message, ping)
     process_message();
     // verify contents of report
     verify_report_header(0);    // type PONG
+    TEST_ASSERT_EQUAL_UINT8(0, rptbuf[5]);
+    TEST_ASSERT_EQUAL_UINT8(0, rptbuf[6]);
+}
+
+TEST(process_message, enter)
+{
+    // ENTER is answered like a PING, any payload is ignored
+    cmdid = 6;
+    msglen = 1;
+    msgbuf[0] = INFO_APP_LEN;
+    process_message();
+    verify_report_header(0);    // type PONG
+    TEST_ASSERT_EQUAL_UINT8(0, rptbuf[5]);
+    TEST_ASSERT_EQUAL_UINT8(0, rptbuf[6]);
+}
+
+// send a PING with info selector and return the 16-bit value from the PONG
+static uint16_t test_message_ping_info(uint8_t info)
+{
+    cmdid = 0;
+    msglen = 1;
+    msgbuf[0] = info;
+    process_message();
+    verify_report_header(0);
+    ++saved_rxcount;
+    return rptbuf[5] + (rptbuf[6] << 8);
 }
 
 // create a fake image based on random seed
@@ -364,6 +731,200 @@ TEST(process_message, stop_bad)
     TEST_ASSERT_EACH_EQUAL_UINT8(0xFF, &eepmem[E2END-3], 4);
 }
 
+TEST(process_message, stop_bad_stats)
+{
+    stats_clear();
+    test_crc = 0;
+    flash_reset();
+    eep_reset();
+    uint8_t *testimg = create_image(19, 8);
+    test_message_start(8);
+    test_message_data_end(testimg, 8);
+    test_message_stop_bad();
+    TEST_ASSERT_EQUAL_UINT16(1, stats[STAT_CRC_FAILS]);
+}
+
+// send a RUN message and verify the response
+// expected is 1 if the app should be starting
+static void test_message_run(uint8_t expected)
+{
+    cmdid = 1;
+    msglen = 0;
+    run_app = false;
+
+    process_message();
+
+    // verify report
+    verify_report_header(4);
+    TEST_ASSERT_EQUAL_UINT8(expected, rptbuf[5]);
+    TEST_ASSERT_EQUAL(expected, run_app);
+
+    ++saved_rxcount;
+    run_app = false;
+}
+
+// load the test image, len bytes (multiple of 8), over the current flash
+static void test_send_image(uint16_t len)
+{
+    test_crc = 0;
+    test_message_start(len);
+    for (uint16_t idx = 0; idx < (len - 8); idx += 8) {
+        test_message_data_ongoing(&test_image[idx]);
+    }
+    test_message_data_end(&test_image[len - 8], 8);
+    test_message_stop();
+}
+
+// load a complete image of len bytes (multiple of 8)
+static void test_load_image(unsigned seed, uint16_t len)
+{
+    flash_reset();
+    eep_reset();
+    create_image(seed, len);
+    test_send_image(len);
+}
+
+TEST(process_message, page_same)
+{
+    stats_clear();
+
+    // every page of a load is erased and written
+    test_load_image(5, 2 * SPM_PAGESIZE);
+    TEST_ASSERT_EQUAL_UINT16(2, stats[STAT_PAGES_ERASED]);
+    TEST_ASSERT_EQUAL_UINT16(2, stats[STAT_PAGES_WRITTEN]);
+    TEST_ASSERT_EQUAL_UINT16(0, stats[STAT_PAGES_SAME]);
+
+    // the same image again is counted, but still programmed
+    test_send_image(2 * SPM_PAGESIZE);
+    TEST_ASSERT_EQUAL_UINT16(4, stats[STAT_PAGES_ERASED]);
+    TEST_ASSERT_EQUAL_UINT16(4, stats[STAT_PAGES_WRITTEN]);
+    TEST_ASSERT_EQUAL_UINT16(2, stats[STAT_PAGES_SAME]);
+
+    // a change in the second page
+    TEST_ASSERT_NOT_EQUAL(0xFF, test_image[200]);
+    test_image[200] |= test_image[200] + 1;
+    test_send_image(2 * SPM_PAGESIZE);
+    TEST_ASSERT_EQUAL_UINT16(6, stats[STAT_PAGES_ERASED]);
+    TEST_ASSERT_EQUAL_UINT16(6, stats[STAT_PAGES_WRITTEN]);
+    TEST_ASSERT_EQUAL_UINT16(3, stats[STAT_PAGES_SAME]);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(test_image, flashmem, 2 * SPM_PAGESIZE);
+}
+
+// send a STATS with a selector and return the 16-bit value from the report
+static uint16_t test_message_stats(uint8_t sel)
+{
+    cmdid = 7;
+    msglen = 1;
+    msgbuf[0] = sel;
+    process_message();
+    verify_report_header(7);
+    ++saved_rxcount;
+    return rptbuf[5] + (rptbuf[6] << 8);
+}
+
+TEST(process_message, stats)
+{
+    for (uint8_t i = 0; i < STAT_COUNT; ++i) {
+        stats[i] = 0x100 + i;
+    }
+    for (uint8_t i = 0; i < STAT_COUNT; ++i) {
+        TEST_ASSERT_EQUAL_UINT16(0x100 + i, test_message_stats(i));
+    }
+    // 8 MHz clock divided by 1024
+    TEST_ASSERT_EQUAL_UINT16(128, test_message_stats(STAT_COUNT));
+    TEST_ASSERT_EQUAL_UINT16(0, test_message_stats(0x80));
+    // clear
+    TEST_ASSERT_EQUAL_UINT16(0, test_message_stats(0xFF));
+    TEST_ASSERT_EACH_EQUAL_UINT16(0, stats, STAT_COUNT);
+}
+
+TEST(process_message, ping_info)
+{
+    test_load_image(8, 48);
+    TEST_ASSERT_EQUAL_UINT16(48, test_message_ping_info(1));
+    TEST_ASSERT_EQUAL_UINT16(test_crc, test_message_ping_info(2));
+    // no tag provided with the STOP
+    TEST_ASSERT_EQUAL_UINT16(0xFFFF, test_message_ping_info(3));
+    // unknown info selector
+    TEST_ASSERT_EQUAL_UINT16(0, test_message_ping_info(0xEE));
+}
+
+TEST(process_message, ping_ram)
+{
+    // test_ram stands in for RAM, 16 bytes of static variables and the
+    // stack above that, up to index 63
+    paint_stack();
+    TEST_ASSERT_EQUAL_UINT16(0, test_message_ping_info(4));
+    // simulate stack use down to index 50
+    test_ram[50] = 0;
+    TEST_ASSERT_EQUAL_UINT16(14, test_message_ping_info(4));
+    TEST_ASSERT_EQUAL_UINT16(16, test_message_ping_info(5));
+}
+
+TEST(process_message, ping_can_diag)
+{
+    rx_overruns = 3;
+    tx_errors = 0x1234;
+    busoff_count = 2;
+    reset_all();
+    CANTEC_reg8.data[0] = 0x10;
+    CANREC_reg8.data[0] = 0x20;
+    TEST_ASSERT_EQUAL_UINT16(3, test_message_ping_info(6));
+    TEST_ASSERT_EQUAL_UINT16(0x1234, test_message_ping_info(7));
+    TEST_ASSERT_EQUAL_UINT16(2, test_message_ping_info(8));
+    TEST_ASSERT_EQUAL_UINT16(0x2010, test_message_ping_info(9));
+}
+
+TEST(process_message, stop_tag)
+{
+    test_crc = 0;
+    flash_reset();
+    eep_reset();
+    uint8_t *testimg = create_image(9, 16);
+    test_message_start(16);
+    test_message_data_ongoing(&testimg[0]);
+    test_message_data_end(&testimg[8], 8);
+
+    // STOP with CRC and version tag
+    cmdid = 4;
+    msglen = 4;
+    msgbuf[0] = test_crc;
+    msgbuf[1] = test_crc >> 8;
+    msgbuf[2] = 0x34;
+    msgbuf[3] = 0x12;
+    process_message();
+    verify_report_header(3);
+    TEST_ASSERT_EQUAL_UINT8(1, rptbuf[5]);
+    ++saved_rxcount;
+
+    // tag is stored and reported
+    uint16_t eep_tag = eepmem[E2END-6] + (eepmem[E2END-5] << 8);
+    TEST_ASSERT_EQUAL_UINT16(0x1234, eep_tag);
+    TEST_ASSERT_EQUAL_UINT16(0x1234, test_message_ping_info(3));
+}
+
+TEST(process_message, run)
+{
+    test_load_image(5, 40);
+    // image is good so app should be starting
+    test_message_run(1);
+}
+
+TEST(process_message, run_no_image)
+{
+    // nothing ever loaded
+    eep_reset();
+    test_message_run(0);
+}
+
+TEST(process_message, run_bad_image)
+{
+    test_load_image(6, 32);
+    // corrupt the image in flash after it was loaded
+    test_image[17] ^= 0x20;
+    test_message_run(0);
+}
+
 TEST_GROUP_RUNNER(process_message)
 {
     RUN_TEST_CASE(process_message, ping);
@@ -372,13 +933,176 @@ TEST_GROUP_RUNNER(process_message)
     RUN_TEST_CASE(process_message, data_end);
     RUN_TEST_CASE(process_message, stop);
     RUN_TEST_CASE(process_message, stop_bad);
+    RUN_TEST_CASE(process_message, ping_info);
+    RUN_TEST_CASE(process_message, stop_tag);
+    RUN_TEST_CASE(process_message, run);
+    RUN_TEST_CASE(process_message, run_no_image);
+    RUN_TEST_CASE(process_message, run_bad_image);
+    RUN_TEST_CASE(process_message, enter);
+    RUN_TEST_CASE(process_message, ping_ram);
+    RUN_TEST_CASE(process_message, ping_can_diag);
+    RUN_TEST_CASE(process_message, stop_bad_stats);
+    RUN_TEST_CASE(process_message, page_same);
+    RUN_TEST_CASE(process_message, stats);
+}
+
+/*****************************************************************************/
+
+TEST_GROUP(app_main);
+
+static jmp_buf app_jump;
+
+// stands in for the app reset vector, returns to test_app_main()
+static void test_app_reset(void)
+{
+    longjmp(app_jump, 1);
+}
+
+// run the boot loader main with an image of len bytes loaded (0 for none)
+// returns true if it jumped to the app, false if it timed out
+static bool test_app_main(uint8_t cause, uint8_t flags, uint16_t len)
+{
+    if (len) {
+        test_load_image(5, len);
+    } else {
+        flash_reset();
+        eep_reset();
+    }
+    eeprom_update_byte(EEP_BOOT_FLAGS, flags);
+    app_check = APP_UNCHECKED;
+    reset_all();
+    memset(CANSTMOB_reg8.data, _BV(TXOK), sizeof(CANSTMOB_reg8.data));
+    reset_cause = cause;
+    wdt_reset_count = 0;
+    pgm_reads = 0;
+    if (setjmp(app_jump)) {
+        return true;
+    }
+    app_main();
+    return false;
+}
+
+TEST_SETUP(app_main)
+{
+    swreset = test_app_reset;
+    stats_clear();
+}
+
+TEST_TEAR_DOWN(app_main)
+{
+    swreset = 0;
+}
+
+TEST(app_main, zero_wait)
+{
+    // the app starts right away, without a session
+    TEST_ASSERT_TRUE(test_app_main(_BV(PORF), 0xFE, 40));
+    TEST_ASSERT_EQUAL_UINT(0, wdt_reset_count);
+    TEST_ASSERT_EQUAL_UINT16(0, stats[STAT_SESSIONS]);
+}
+
+TEST(app_main, zero_wait_no_app)
+{
+    // the boot loader stays for the boot timeout
+    TEST_ASSERT_FALSE(test_app_main(_BV(PORF), 0xFE, 0));
+    TEST_ASSERT_EQUAL_UINT(BOOT_TIMEOUT + 1, wdt_reset_count);
+    TEST_ASSERT_EQUAL_UINT16(1, stats[STAT_SESSIONS]);
+}
+
+TEST(app_main, wait)
+{
+    // the default waits for the boot timeout before starting the app
+    TEST_ASSERT_TRUE(test_app_main(_BV(PORF), 0xFF, 40));
+    TEST_ASSERT_EQUAL_UINT(BOOT_TIMEOUT + 1, wdt_reset_count);
+    TEST_ASSERT_EQUAL_UINT16(1, stats[STAT_SESSIONS]);
+}
+
+TEST(app_main, zero_wait_resident)
+{
+    // a watchdog reset or a boot request stays for the activity timeout,
+    // even in zero-wait mode
+    TEST_ASSERT_TRUE(test_app_main(_BV(WDRF), 0xFE, 40));
+    TEST_ASSERT_EQUAL_UINT(ACTIVITY_TIMEOUT + 1, wdt_reset_count);
+    TEST_ASSERT_EQUAL_UINT16(1, stats[STAT_SESSIONS]);
+    stats_clear();
+    TEST_ASSERT_TRUE(test_app_main(_BV(PORF) | _BV(BOOTREQF), 0xFE, 40));
+    TEST_ASSERT_EQUAL_UINT(ACTIVITY_TIMEOUT + 1, wdt_reset_count);
+    TEST_ASSERT_EQUAL_UINT16(1, stats[STAT_SESSIONS]);
+}
+
+TEST(app_main, check_once)
+{
+    // the ANNOUNCE and the app start at the timeout share one CRC
+    TEST_ASSERT_TRUE(test_app_main(_BV(WDRF), 0xFF, 40));
+    TEST_ASSERT_EQUAL_UINT8(6, CANMSG_reg8.data[4]);    // ANNOUNCE
+    TEST_ASSERT_EQUAL_UINT8(1, CANMSG_reg8.data[5]);    // valid app
+    TEST_ASSERT_EQUAL_UINT(40, pgm_reads);
+
+    // a load checks again
+    test_load_image(6, 48);
+    TEST_ASSERT_EQUAL_UINT8(APP_UNCHECKED, app_check);
+    pgm_reads = 0;
+    TEST_ASSERT_TRUE(app_is_valid());
+    TEST_ASSERT_EQUAL_UINT(48, pgm_reads);
+}
+
+TEST_GROUP_RUNNER(app_main)
+{
+    RUN_TEST_CASE(app_main, zero_wait);
+    RUN_TEST_CASE(app_main, zero_wait_no_app);
+    RUN_TEST_CASE(app_main, wait);
+    RUN_TEST_CASE(app_main, zero_wait_resident);
+    RUN_TEST_CASE(app_main, check_once);
+}
+
+/*****************************************************************************/
+
+TEST_GROUP(canboot_app);
+
+TEST_SETUP(canboot_app)
+{
+    eep_reset();
+}
+
+TEST_TEAR_DOWN(canboot_app)
+{
+}
+
+TEST(canboot_app, enter_request)
+{
+    TEST_ASSERT_TRUE(canboot_is_enter_request(3, 0x1B007136UL));
+    // other board
+    TEST_ASSERT_FALSE(canboot_is_enter_request(4, 0x1B007136UL));
+    // other command
+    TEST_ASSERT_FALSE(canboot_is_enter_request(3, 0x1B007130UL));
+}
+
+TEST(canboot_app, can_id_config)
+{
+    eep_reset();
+    TEST_ASSERT_EQUAL_HEX32(CANBOOT_CANID, canboot_can_id_base());
+
+    canboot_set_can_id(0x00012300UL, CANBOOT_CANIDMASK);
+    TEST_ASSERT_EQUAL_HEX32(0x00012300UL, canboot_can_id_base());
+    TEST_ASSERT_TRUE(canboot_is_enter_request(3, 0x00012336UL));
+    TEST_ASSERT_FALSE(canboot_is_enter_request(3, 0x1B007136UL));
+}
+
+TEST_GROUP_RUNNER(canboot_app)
+{
+    RUN_TEST_CASE(canboot_app, enter_request);
+    RUN_TEST_CASE(canboot_app, can_id_config);
 }
 
 static void runner(void)
 {
     //RUN_TEST_GROUP(sample);
     RUN_TEST_GROUP(send_message);
+    RUN_TEST_GROUP(device_init);
+    RUN_TEST_GROUP(reset_cause);
     RUN_TEST_GROUP(process_message);
+    RUN_TEST_GROUP(app_main);
+    RUN_TEST_GROUP(canboot_app);
 }
 
 int main(int argc, const char *argv[])
@@ -26,10 +26,57 @@
 #
 
 import argparse
+import json
+import mmap
+import os
+import random
+import struct
+import sys
+import threading
+import time
 import can
 from intelhex import IntelHex
 
 _can_rate = 250000
+_can_channel = "can0"
+_transport = "socketcan"
+_trace = None   # trace file from --trace, see TraceBus
+
+# CAN ID base of the boot loader messages, see doc/protocol.md
+# this can be changed per installation with the EEPROM CAN ID config
+_id_base = 0x1b007100
+ID_MASK_DEFAULT = 0x1FFFFFF0
+
+# last EEPROM address of each supported MCU, for the CAN ID config
+EEPROM_END = {"atmega16m1": 0x1FF, "atmega32m1": 0x3FF, "atmega64m1": 0x7FF}
+
+# flash page size of each supported MCU, for the bundle page CRCs
+FLASH_PAGE = {"atmega16m1": 128, "atmega32m1": 128, "atmega64m1": 256}
+
+# MCUs the boot loader builds with dual slots by default (CONFIG_DUAL_SLOT)
+DUAL_SLOT = {"atmega16m1": False, "atmega32m1": True, "atmega64m1": True}
+
+# update bundle header, see util/README.md
+BUNDLE_MAGIC = b"CBB1"
+BUNDLE_HEADER = struct.Struct("<4sHHHHHHH")
+BUNDLE_NOTAG = 0x0001   # flags bit, the bundle has no version tag
+
+# PING info selectors, see doc/protocol.md
+INFO_APP_LEN = 1
+INFO_APP_CRC = 2
+INFO_APP_TAG = 3
+INFO_STACK = 4
+INFO_RAM = 5
+INFO_CAN_RXOVR = 6
+INFO_CAN_TXERR = 7
+INFO_CAN_BUSOFF = 8
+INFO_CAN_ERRCNT = 9
+
+# STATS counter selectors, see doc/protocol.md
+STATS_NAMES = ("Sessions", "Frames", "Bad cmds", "Erased", "Written",
+               "Unchanged", "CRC fails", "Flash time", "Idle time")
+STAT_TICK_US = len(STATS_NAMES)
+STAT_CLEAR = 0xFF
 
 # CRC16 implementation that matches the C version in the boot loader
 def crc16_update(crc, val):
@@ -42,44 +89,402 @@ def crc16_update(crc, val):
     return crc & 0xFFFF;
 
 def build_arbid(boardid, cmdid):
-    return 0x1b007100 + (boardid << 4) + cmdid
+    return _id_base + (boardid << 4) + cmdid
+
+# write an Intel hex file with the EEPROM CAN ID config, for a programmer
+# the boot loader uses the new base and mask the next time it starts
+def idconfig(filename, mcu, base, mask):
+    if base & 0xFF:
+        print("ERR: the low byte of the ID base must be 0")
+        return
+    cfg = base.to_bytes(4, "little") + mask.to_bytes(4, "little")
+    crc = 0xFFFF    # not 0, so that all 0 is not a valid config
+    for byte in cfg:
+        crc = crc16_update(crc, byte)
+    cfg += crc.to_bytes(2, "little")
+
+    ih = IntelHex()
+    ih.frombytes(cfg, offset=EEPROM_END[mcu] - 24)
+    ih.write_hex_file(filename)
+    print(f"ID base {base:08X} mask {mask:08X} written to {filename}")
+    print(f"program with: avrdude ... -U eeprom:w:{filename}:i")
+
+# CAN transports
+# open_bus() returns an object with the python-can bus methods send(),
+# recv() and shutdown(), for the transport picked with --transport:
+#
+# - socketcan: SocketCAN raw socket
+# - bcm: SocketCAN raw socket, plus batches sent by the kernel broadcast
+#   manager, see send_batch()
+# - serial: serial-line (slcan) adapter, the channel is the serial port
+# - loopback: simulated boot loaders in this process, for testing without
+#   hardware. The channel is a list of board IDs (0,1,...), or board 0 if
+#   it is not a list.
+TRANSPORTS = ("socketcan", "bcm", "serial", "loopback")
+
+# open a bus on channel, or the --channel default
+# if reports_only, then only REPORT messages from any board ID are received
+def open_bus(channel=None, reports_only=False):
+    channel = channel or _can_channel
+    filters = None
+    if reports_only:
+        filters = [{"can_id": build_arbid(boardid=0, cmdid=5),
+                    "can_mask": 0x1FFFFF0F, "extended": True}]
+
+    if _transport == "loopback":
+        bus = LoopbackBus(channel, filters)
+    elif _transport == "serial":
+        bus = can.interface.Bus(bustype="slcan", channel=channel, bitrate=_can_rate,
+                                can_filters=filters)
+    else:
+        bus = can.interface.Bus(bustype="socketcan", channel=channel, bitrate=_can_rate,
+                                can_filters=filters)
+        if _transport == "bcm":
+            bus = BcmBus(bus, channel)
+
+    if _trace is not None:
+        bus = TraceBus(bus, channel, _trace)
+    return bus
+
+# send a list of messages back to back
+# the bcm transport hands them to the kernel in one call, the others send
+# them one at a time
+def send_batch(canbus, msgs):
+    if hasattr(canbus, "send_batch"):
+        canbus.send_batch(msgs)
+    else:
+        for msg in msgs:
+            canbus.send(msg)
+
+# SocketCAN bus that sends batches with the broadcast manager (BCM)
+# A batch is one TX_SETUP with a frame sequence that is sent once, so the
+# kernel paces the frames instead of python. Everything else goes to the
+# raw socket bus.
+class BcmBus:
+    TX_SETUP = 1
+    SETTIMER = 0x0001
+    STARTTIMER = 0x0002
+    CAN_EFF_FLAG = 0x80000000
+    MAX_FRAMES = 256
+    # time between the frames of a batch, a bit more than one frame time
+    PACE_US = 600
+
+    def __init__(self, rawbus, channel):
+        import socket
+        self.rawbus = rawbus
+        self.bcm = socket.socket(socket.AF_CAN, socket.SOCK_DGRAM, socket.CAN_BCM)
+        self.bcm.connect((channel,))
+        self.idle = 0   # when the last batch is done
+
+    def send(self, msg, timeout=None):
+        self.rawbus.send(msg, timeout)
+
+    def recv(self, timeout=None):
+        return self.rawbus.recv(timeout)
+
+    def send_batch(self, msgs):
+        for first in range(0, len(msgs), self.MAX_FRAMES):
+            frames = msgs[first:first + self.MAX_FRAMES]
+            # a new TX_SETUP with the same CAN ID replaces one that is still
+            # sending
+            now = time.monotonic()
+            if now < self.idle:
+                time.sleep(self.idle - now)
+
+            canid = frames[0].arbitration_id | self.CAN_EFF_FLAG
+            head = struct.pack("@3I4l2I0q", self.TX_SETUP,
+                               self.SETTIMER | self.STARTTIMER, len(frames),
+                               0, self.PACE_US, 0, 0, canid, len(frames))
+            body = b"".join(struct.pack("=IB3x8s", msg.arbitration_id | self.CAN_EFF_FLAG,
+                                        msg.dlc, bytes(msg.data))
+                            for msg in frames)
+            self.bcm.send(head + body)
+            self.idle = time.monotonic() + len(frames) * self.PACE_US / 1e6
+
+    def shutdown(self):
+        self.bcm.close()
+        self.rawbus.shutdown()
+
+# bus that records every message sent and received to a trace file
+# The file has the candump log format, with the monotonic time in place of
+# the time of day. Only the host sends commands and only targets send
+# REPORTs, so the direction is in the CAN ID. The buses of all the threads
+# of a rollout write to the same file.
+class TraceBus:
+    lock = threading.Lock()
+
+    def __init__(self, canbus, channel, tracefile):
+        self.bus = canbus
+        self.channel = channel
+        self.tracefile = tracefile
+
+    def log(self, msg, stamp):
+        line = f"({stamp:.6f}) {self.channel} " \
+               f"{msg.arbitration_id:08X}#{bytes(msg.data).hex().upper()}\n"
+        with self.lock:
+            self.tracefile.write(line)
+
+    def send(self, msg, timeout=None):
+        stamp = time.monotonic()
+        self.bus.send(msg, timeout)
+        self.log(msg, stamp)
+
+    def send_batch(self, msgs):
+        stamp = time.monotonic()
+        send_batch(self.bus, msgs)
+        for msg in msgs:
+            self.log(msg, stamp)
+
+    def recv(self, timeout=None):
+        msg = self.bus.recv(timeout)
+        if msg is not None:
+            self.log(msg, time.monotonic())
+        return msg
+
+    def shutdown(self):
+        self.bus.shutdown()
+
+# read a candump log file, such as a trace from --trace
+# returns a list of tuples (time, channel, CAN ID, data)
+def read_trace(filename):
+    frames = []
+    with open(filename) as tfile:
+        for line in tfile:
+            fields = line.split()
+            if len(fields) < 3 or "#" not in fields[2]:
+                continue
+            arbid, data = fields[2].split("#", 1)
+            frames.append((float(fields[0].strip("()")), fields[1], int(arbid, 16),
+                           bytes.fromhex(data)))
+    return frames
+
+# simulated boot loader for the loopback transport
+# It follows the protocol with one app image, and takes about as long as a
+# target for the CAN frames and flash page writes. The app image, length,
+# CRC and tag are kept while the process runs. It does not have the STATS
+# command, like a build without CONFIG_STATS.
+class LoopbackNode:
+    APP_SIZE = 0x3800   # 14K app on ATmega16M1
+    PAGE_SIZE = 128
+    PAGE_TIME = 0.009   # page erase and write
+    VERSION = (0, 0, 0)
+
+    def __init__(self, boardid):
+        self.boardid = boardid
+        self.flash = bytearray(b"\xFF" * self.APP_SIZE)
+        self.app = (0xFFFF, 0xFFFF, 0xFFFF)     # length, CRC, tag
+        self.running = False
+        self.rxcount = 0
+        self.loadaddr = 0
+        self.loadlen = 0
+        self.crc = 0
+        self.busy = 0   # when the last REPORT is sent
+
+    def app_is_valid(self):
+        applen, appcrc, _ = self.app
+        if applen > self.APP_SIZE:
+            return 0
+        crc = 0
+        for val in self.flash[:applen]:
+            crc = crc16_update(crc, val)
+        return int(crc == appcrc)
+
+    # process a message to this board
+    # returns tuple (report type, report data, processing time), or None if
+    # there is no REPORT
+    def process(self, cmdid, data):
+        if self.running:
+            if cmdid != 6:
+                return None
+            # the app resets into the boot loader, with a WDT reset
+            self.running = False
+            return 6, self.app_is_valid() | (0x08 << 8), 0  # ANNOUNCE
+
+        self.rxcount = (self.rxcount + 1) & 0xFF
+        if cmdid in (0, 6):    # PING, ENTER
+            info = data[0] if cmdid == 0 and data else 0
+            val = self.app[info - 1] if info in (1, 2, 3) else 0
+            return 0, val, 0
+
+        if cmdid == 1:  # RUN
+            valid = self.app_is_valid()
+            self.running = bool(valid)
+            return 4, valid, 0
+
+        if cmdid == 2:  # START
+            self.loadlen = data[0] + (data[1] << 8)
+            self.loadaddr = 0
+            self.crc = 0
+            return 1, 0, 0
+
+        if cmdid == 3:  # DATA
+            if self.loadaddr >= self.loadlen or self.loadaddr + 8 > self.APP_SIZE:
+                return 5, 0, 0
+            self.flash[self.loadaddr:self.loadaddr + 8] = bytes(data).ljust(8, b"\0")
+            for val in self.flash[self.loadaddr:self.loadaddr + 8]:
+                self.crc = crc16_update(self.crc, val)
+            self.loadaddr += 8
+            if self.loadaddr >= self.loadlen or self.loadaddr % self.PAGE_SIZE == 0:
+                return (1 if self.loadaddr < self.loadlen else 2), 0, self.PAGE_TIME
+            return 1, 0, 0
+
+        if cmdid == 4:  # STOP
+            ok = (data[0] + (data[1] << 8)) == self.crc
+            if ok:
+                tag = data[2] + (data[3] << 8) if len(data) >= 4 else 0xFFFF
+                self.app = (self.loadlen, self.crc, tag)
+            return 3, int(ok), 0
+
+        return 5, cmdid, 0  # ERR
+
+# bus with simulated boot loaders, see LoopbackNode
+# Buses with the same channel share the same nodes. The REPORTs are delayed
+# by the frame time at the data rate, and the processing time of the node.
+# Each node takes one message at a time, but the nodes are independent.
+class LoopbackBus:
+    _nodes = {}
+    FRAME_BITS = 135    # 8 byte frame with extended ID and some stuffing
+
+    def __init__(self, channel, filters=None):
+        try:
+            boardids = [int(b, 0) for b in channel.split(",")]
+        except ValueError:
+            boardids = [0]
+        nodes = LoopbackBus._nodes.setdefault(channel, {})
+        self.nodes = {b: nodes.setdefault(b, LoopbackNode(b)) for b in boardids}
+        self.filters = filters
+        self.frame_time = self.FRAME_BITS / _can_rate
+        self.rxq = []   # (time, message), in time order
+
+    def send(self, msg, timeout=None):
+        boardid = (msg.arbitration_id >> 4) & 0x0F
+        cmdid = msg.arbitration_id & 0x0F
+        node = self.nodes.get(boardid)
+        if msg.arbitration_id != build_arbid(boardid, cmdid) or node is None:
+            return
+        reply = node.process(cmdid, msg.data)
+        if reply is None:
+            return
+
+        rptype, val, proctime = reply
+        node.busy = max(node.busy, time.monotonic()) + 2 * self.frame_time + proctime
+        data = list(node.VERSION) + [1, rptype, val & 0xFF, (val >> 8) & 0xFF,
+                                     node.rxcount]
+        rptmsg = can.Message(arbitration_id=build_arbid(boardid, 5),
+                             is_extended_id=True, data=data)
+        if self.matches(rptmsg):
+            self.rxq.append((node.busy, rptmsg))
+            self.rxq.sort(key=lambda item: item[0])
+
+    def matches(self, msg):
+        return not self.filters or any(
+            (msg.arbitration_id & f["can_mask"]) == (f["can_id"] & f["can_mask"])
+            for f in self.filters)
+
+    def recv(self, timeout=None):
+        now = time.monotonic()
+        if not self.rxq:
+            if timeout:
+                time.sleep(timeout)
+            return None
+        due, msg = self.rxq[0]
+        if timeout is not None and due > now + timeout:
+            time.sleep(timeout)
+            return None
+        if due > now:
+            time.sleep(due - now)
+        self.rxq.pop(0)
+        return msg
+
+    def shutdown(self):
+        pass
+
+# send a PING to each board back-to-back and collect the PONGs
+# payload is the PING payload, such as an info selector
+# the replies are matched to the boards by the board ID in the CAN ID, so all
+# the boards are queried within one timeout
+# returns dict of boardid to PONG payload, for the boards that replied
+def burst_ping(canbus, boardids, payload=(), timeout=0.1):
+    boardids = list(boardids)
+    send_batch(canbus, [can.Message(arbitration_id=build_arbid(boardid=b, cmdid=0),
+                                    is_extended_id=True, data=list(payload))
+                        for b in boardids])  # PING
+
+    replies = {}
+    deadline = time.monotonic() + timeout
+    while len(replies) < len(boardids):
+        remaining = deadline - time.monotonic()
+        if remaining <= 0:
+            break
+        rxmsg = canbus.recv(timeout=remaining)
+        if rxmsg is None:
+            break
+        boardid = (rxmsg.arbitration_id >> 4) & 0x0F
+        if ((rxmsg.arbitration_id == build_arbid(boardid=boardid, cmdid=5))
+            and (rxmsg.dlc == 8) and (rxmsg.data[4] == 0)
+            and (boardid in boardids)):
+            replies[boardid] = rxmsg.data
+
+    return replies
 
 # scan for any board running the CAN boot loader
+# all the board IDs are pinged at once, then the boards that replied are asked
+# for their app length, CRC and tag with one burst each, so the scan takes up
+# to four reply timeouts
 def scan():
-    arbid = build_arbid(0, 0)  # initial arb id, cmd=0/PING, boardid=0
-    bus = can.interface.Bus(bustype="socketcan", channel="can0", bitrate=_can_rate)
-    msg = can.Message(arbitration_id=arbid, is_extended_id=True, data=[])
+    bus = open_bus(reports_only=True)
 
     print("Scanning for CAN boot loaders")
+    found = burst_ping(bus, range(16))
+    if not found:
+        print("No boot loaders found")
+        return
 
-    for boardid in range(16):
-        print(f"{boardid:02d} ... ", end="")
-        msg.arbitration_id = build_arbid(boardid=boardid, cmdid=0)
-        # send the ping message to the address
-        bus.send(msg)
-
-        # check for a reply
-        rxmsg = bus.recv(timeout=0.1)
-        if rxmsg:
-            expid = arbid + (boardid << 4) + 5  # expected REPORT arbid
-            # check for proper PONG response
-            if ((rxmsg.arbitration_id == expid)
-                and (rxmsg.dlc == 8)
-                and (rxmsg.data[4] == 0)):
-                    print("OK")
-            else:
-                print("err")
-                print(rxmsg)
+    # app identity of the boards that were found
+    ident = {info: burst_ping(bus, found, payload=[info])
+             for info in (INFO_APP_LEN, INFO_APP_CRC, INFO_APP_TAG)}
 
-        # no response
-        else:
-            print()
+    print("ID  Version   Status  App len  App CRC  App tag")
+    for boardid, payload in sorted(found.items()):
+        verstr = f"{payload[0]}.{payload[1]}.{payload[2]}"
+        statstr = "OK" if (payload[3] == 1) else "Err"
+        vals = []
+        for info in (INFO_APP_LEN, INFO_APP_CRC, INFO_APP_TAG):
+            rpt = ident[info].get(boardid)
+            vals.append("-" if rpt is None else f"{rpt[5] + (rpt[6] << 8):04X}")
+        print(f"{boardid:02d}  {verstr:8}  {statstr:6}  {vals[0]:7}  {vals[1]:7}  {vals[2]}")
+
+# passively listen for boot loader ANNOUNCE reports
+# every target sends one when the boot loader starts, so this shows boards
+# entering the boot loader as it happens, without sending anything
+def listen():
+    bus = open_bus(reports_only=True)
+
+    print("Listening for CAN boot loaders (ctrl-C to stop)")
+
+    try:
+        while True:
+            rxmsg = bus.recv(timeout=1.0)
+            if rxmsg is None:
+                continue
+            payload = rxmsg.data
+            if (rxmsg.dlc != 8) or (payload[4] != 6):
+                continue
+            boardid = (rxmsg.arbitration_id >> 4) & 0x0F
+            verstr = f"{payload[0]}.{payload[1]}.{payload[2]}"
+            appstr = "valid" if payload[5] == 1 else "invalid"
+            tstamp = time.strftime("%H:%M:%S")
+            print(f"{tstamp} board {boardid:02d} version {verstr} "
+                  f"app {appstr} reset {payload[6]:02X}")
+
+    except KeyboardInterrupt:
+        pass
 
 # send a PING to a specified boardid
 # pretty print the reply information such as boot laoder version
 def ping(boardid):
     arbid = build_arbid(boardid=boardid, cmdid=0)  # PING
-    bus = can.interface.Bus(bustype="socketcan", channel="can0", bitrate=_can_rate)
+    bus = open_bus()
     msg = can.Message(arbitration_id=arbid, is_extended_id=True, data=[])
     bus.send(msg)
 
@@ -96,16 +501,56 @@ def ping(boardid):
         print(f"Board ID: {boardid}")
         print(f"Version:  {verstr}")
         print(f"Status:   {statstr}")
-        print(f"payload 5/6: {payload[5]:02X} {payload[6]:02X}")
+
+        ident = query_identity(bus, boardid)
+        if ident:
+            applen, appcrc, apptag = ident
+            tagstr = "none" if apptag == 0xFFFF else f"{apptag:04X}"
+            print(f"App len:  {applen:04X}")
+            print(f"App CRC:  {appcrc:04X}")
+            print(f"App tag:  {tagstr}")
+
+        # boot loader RAM use, stack peak is 0 if not built with painting
+        stack = query_info(bus, boardid, INFO_STACK)
+        ram = query_info(bus, boardid, INFO_RAM)
+        if stack is not None and ram is not None:
+            print(f"RAM:      {ram} static, {stack} peak stack")
+
+        # CAN error counters, all 0 if not built with CAN diagnostics
+        diag = tuple(query_info(bus, boardid, info)
+                     for info in (INFO_CAN_RXOVR, INFO_CAN_TXERR,
+                                  INFO_CAN_BUSOFF, INFO_CAN_ERRCNT))
+        if None not in diag:
+            rxovr, txerr, busoff, errcnt = diag
+            print(f"CAN:      {rxovr} rx overrun, {txerr} tx error, "
+                  f"{busoff} bus-off, TEC {errcnt & 0xFF} REC {errcnt >> 8}")
 
     else:
         print("No reply")
 
+# send a PING with an info selector, on an existing bus
+# returns the 16-bit info value from the PONG, or None if no reply
+def query_info(canbus, boardid, info):
+    arbid = build_arbid(boardid=boardid, cmdid=0)  # PING
+    msg = can.Message(arbitration_id=arbid, is_extended_id=True, data=[info])
+    canbus.send(msg)
+    rpt = get_report(canbus)
+    if rpt is None or rpt[4] != 0:
+        return None
+    return rpt[5] + (rpt[6] << 8)
+
+# get the identity of the app image stored on the target
+# returns tuple (len, crc, tag), or None if the target did not reply
+def query_identity(canbus, boardid):
+    ident = tuple(query_info(canbus, boardid, info)
+                  for info in (INFO_APP_LEN, INFO_APP_CRC, INFO_APP_TAG))
+    return None if None in ident else ident
+
 # get CAN message and verify it is a REPORT
 # if so, return the message payload
 # else return None
-def get_report(canbus):
-    msg = canbus.recv(timeout=0.1)
+def get_report(canbus, timeout=0.1):
+    msg = canbus.recv(timeout=timeout)
     if msg:
         rxcmd = msg.arbitration_id & 0x0F
         if rxcmd == 5:
@@ -113,123 +558,961 @@ def get_report(canbus):
 
     return None
 
-# upload the hex file filename, to the specified boardid
-# using the CAN protocol
-def load(boardid, filename):
+# send RUN to the boardid, on an existing bus
+# the target checks the app image (which takes a while) before it replies
+# returns True if the target reports the app is starting
+def send_run(canbus, boardid):
+    arbid = build_arbid(boardid=boardid, cmdid=1)
+    msg = can.Message(arbitration_id=arbid, is_extended_id=True, data=[])
+    canbus.send(msg)
+    rpt = get_report(canbus, timeout=1.0)
+    if rpt is not None and rpt[4] == 5 and rpt[5] == 1:
+        print("Target has no RUN command, the app starts at the boot timeout")
+        return False
+    if rpt is None or rpt[4] != 4:
+        print("ERR: did not recieve RUN report")
+        print("report:", rpt)
+        return False
+
+    if rpt[5] != 1:
+        print("ERR: target indicates app verification failed")
+        return False
+
+    print("App is starting")
+    return True
+
+# tell the boot loader at boardid to start the app now
+def run(boardid):
+    bus = open_bus()
+    send_run(bus, boardid)
+
+# ask the app running on boardid to reset into the boot loader
+# this needs the app to use the companion library (src/canboot_app.c)
+# waits for the ANNOUNCE report from the boot loader
+def enter(boardid):
+    bus = open_bus()
+    arbid = build_arbid(boardid=boardid, cmdid=6)  # ENTER
+    msg = can.Message(arbitration_id=arbid, is_extended_id=True, data=[])
+    bus.send(msg)
+
+    # the app resets with a short watchdog timeout, so the boot loader
+    # should announce itself well within a second
+    deadline = time.monotonic() + 1.0
+    while time.monotonic() < deadline:
+        rpt = get_report(bus, timeout=0.1)
+        if rpt is None:
+            continue
+        if rpt[4] == 6:
+            print("Target is in the boot loader")
+            return True
+        if rpt[4] == 0 or (rpt[4] == 5 and rpt[5] == 6):
+            # PONG, or ERR from a small build
+            print("Target was already in the boot loader")
+            return True
+
+    print("ERR: no reply from target, app may not support ENTER")
+    print("(a small build boot loader does not announce, check with ping)")
+    return False
+
+# send a STATS with a counter selector, on an existing bus
+# returns the 16-bit counter from the report, or None if no STATS reply
+def query_stat(canbus, boardid, sel):
+    arbid = build_arbid(boardid=boardid, cmdid=7)  # STATS
+    msg = can.Message(arbitration_id=arbid, is_extended_id=True, data=[sel])
+    canbus.send(msg)
+    rpt = get_report(canbus)
+    if rpt is None or rpt[4] != 7:
+        return None
+    return rpt[5] + (rpt[6] << 8)
+
+# read and print the session statistics of the boot loader at boardid
+# if clear, then the counters are cleared after they are read
+def stats(boardid, clear=False):
+    bus = open_bus()
+    tick_us = query_stat(bus, boardid, STAT_TICK_US)
+    if tick_us is None:
+        print("ERR: no STATS reply, boot loader may be built without stats")
+        return
+
+    for sel, name in enumerate(STATS_NAMES):
+        val = query_stat(bus, boardid, sel)
+        if val is None:
+            print(f"{name + ':':11} no reply")
+        elif name.endswith("time"):
+            print(f"{name + ':':11} {val} ({val * tick_us / 1000:.1f} ms)")
+        else:
+            print(f"{name + ':':11} {val}")
+
+    if clear:
+        query_stat(bus, boardid, STAT_CLEAR)
+        print("Counters cleared")
+
+# read the hex file or bundle filename and prepare it for loading
+# returns tuple (imgdata, imglen, loadcrc, tag), or None if the file can't be
+# used. The tag is None if the file does not have one.
+def read_image(filename, mcu):
+    with open(filename, "rb") as imgfile:
+        if imgfile.read(len(BUNDLE_MAGIC)) == BUNDLE_MAGIC:
+            return read_bundle(filename, mcu)
+
     # load the hex file
     ih = IntelHex(filename)
 
     # make sure is just one segment and it starts at 0
     segs = ih.segments()
     if len(segs) != 1:
-        print("ERR: more than one segment in hex file")
-        return
+        print("ERR: more than one segment in hex file", file=sys.stderr)
+        return None
     seg = segs[0]
     imgaddr = seg[0]
     imglen = seg[1]
     if imgaddr != 0:
-        print("ERR: image segment does not start at address 0")
-        return
+        print("ERR: image segment does not start at address 0", file=sys.stderr)
+        return None
 
-    print(f"original image length: {imglen}")
+    print(f"original image length: {imglen}", file=sys.stderr)
 
     # pad out to multiple of 8 bytes length
     padlen = 8 - (imglen % 8)
-    print(f"padlen: {padlen}")
+    print(f"padlen: {padlen}", file=sys.stderr)
     if padlen != 0:
         for idx in range(imglen, imglen+padlen):
             ih[idx] = 0
     imglen = len(ih)    # new image length
-    print(f"new image len: {imglen}")
+    print(f"new image len: {imglen}", file=sys.stderr)
 
-    bus = can.interface.Bus(bustype="socketcan", channel="can0", birate=_can_rate)
+    # CRC of the padded image
+    imgdata = ih.tobinarray(start=0, size=imglen)
+    loadcrc = 0
+    for val in imgdata:
+        loadcrc = crc16_update(loadcrc, val)
 
-    # send start command
-    arbid = build_arbid(boardid=boardid, cmdid=2)
-    msg = can.Message(arbitration_id=arbid, is_extended_id=True,
-                      data=[imglen & 0xFF, (imglen >> 8) & 0xFF])
-    bus.send(msg)
-    # verify READY report
-    rpt = get_report(bus)
-    if rpt is None or rpt[4] != 1:
-        print("ERR: did not recieve READY after START")
-        print("report:", rpt)
+    return imgdata, imglen, loadcrc, None
+
+# write an update bundle with the image from the hex file filename
+# The bundle has the padded image and its CRC, so a load does not have to
+# parse the hex file and compute the CRC again. There is also a CRC for each
+# flash page of the mcu.
+def pack(filename, outname, mcu, tag=None):
+    image = read_image(filename, mcu)
+    if image is None:
         return
+    imgdata, imglen, loadcrc, imgtag = image
+    if tag is None:
+        tag = imgtag
 
-    # iterate over image in 8 byte chunks
-    loadcrc = 0
-    for idx in range(0, imglen, 8):
-        print(f"{idx:04X}: ")
-        # create a DATA message
-        arbid = build_arbid(boardid=boardid, cmdid=3)
-        payload = ih.tobinarray(start=idx, size=8)
-        for val in payload:
-            loadcrc = crc16_update(loadcrc, val)
-        msg = can.Message(arbitration_id=arbid, is_extended_id=True,
-                          data=payload)
-        bus.send(msg)
-        rpt = get_report(bus)
-        rptype = 2 if (imglen - idx) == 8 else 1
-        if rpt is None or rpt[4] != rptype:
-            print("ERR: did not recieve READY after DATA")
-            print("report:", rpt)
+    pagesize = FLASH_PAGE[mcu]
+    pagecrcs = []
+    for page in range(0, imglen, pagesize):
+        crc = 0
+        for val in imgdata[page:page + pagesize]:
+            crc = crc16_update(crc, val)
+        pagecrcs.append(crc)
+
+    flags = BUNDLE_NOTAG if tag is None else 0
+    header = BUNDLE_HEADER.pack(BUNDLE_MAGIC, BUNDLE_HEADER.size, imglen, loadcrc,
+                                0xFFFF if tag is None else tag, flags,
+                                pagesize, len(pagecrcs))
+    hdrcrc = 0
+    for val in header:
+        hdrcrc = crc16_update(hdrcrc, val)
+
+    with open(outname, "wb") as outfile:
+        outfile.write(header)
+        outfile.write(struct.pack("<H", hdrcrc))
+        outfile.write(bytes(imgdata))
+        outfile.write(struct.pack(f"<{len(pagecrcs)}H", *pagecrcs))
+
+    tagstr = "none" if tag is None else f"{tag:04X}"
+    print(f"len={imglen:04X} crc={loadcrc:04X} tag={tagstr}, "
+          f"{len(pagecrcs)} pages written to {outname}")
+
+# map the update bundle filename for loading
+# only the header is checked, the image CRC is checked by the target at STOP.
+# The page size has to be the one of mcu.
+# returns tuple (imgdata, imglen, loadcrc, tag), or None if the bundle is bad
+def read_bundle(filename, mcu):
+    with open(filename, "rb") as bfile:
+        bmap = mmap.mmap(bfile.fileno(), 0, access=mmap.ACCESS_READ)
+
+    hdrlen = BUNDLE_HEADER.size
+    if len(bmap) < hdrlen + 2:
+        print("ERR: bundle is too short", file=sys.stderr)
+        return None
+    magic, bhdrlen, imglen, loadcrc, tag, flags, pagesize, pages = \
+        BUNDLE_HEADER.unpack_from(bmap)
+    if bhdrlen != hdrlen:
+        print(f"ERR: bundle header length is {bhdrlen}, {magic.decode()} has {hdrlen}",
+              file=sys.stderr)
+        return None
+    hdrcrc = 0
+    for val in bmap[:hdrlen]:
+        hdrcrc = crc16_update(hdrcrc, val)
+    if hdrcrc != struct.unpack_from("<H", bmap, hdrlen)[0]:
+        print("ERR: bundle header CRC does not match", file=sys.stderr)
+        return None
+    if pagesize != FLASH_PAGE[mcu]:
+        print(f"ERR: bundle has {pagesize} byte pages, {mcu} has {FLASH_PAGE[mcu]}"
+              " (check --mcu)", file=sys.stderr)
+        return None
+    if pages != -(-imglen // pagesize):
+        print("ERR: bundle page count does not match the image length", file=sys.stderr)
+        return None
+    if len(bmap) != hdrlen + 2 + imglen + pages * 2:
+        print("ERR: bundle length does not match the header", file=sys.stderr)
+        return None
+
+    print(f"bundle len={imglen:04X} crc={loadcrc:04X}", file=sys.stderr)
+    imgdata = memoryview(bmap)[hdrlen + 2:hdrlen + 2 + imglen]
+    return imgdata, imglen, loadcrc, None if flags & BUNDLE_NOTAG else tag
+
+# check if the target already has the image
+# the tag is only compared if one was given
+def has_image(canbus, boardid, imglen, loadcrc, tag):
+    ident = query_identity(canbus, boardid)
+    return bool(ident) and (ident[0] == imglen) and (ident[1] == loadcrc) \
+        and (tag is None or ident[2] == tag)
+
+# upload the hex file filename, to the specified boardid
+# using the CAN protocol
+# tag is an optional 16-bit version tag that is stored with the image
+# if skip_same, then the load is skipped if the target already has the image
+def load(boardid, filename, mcu, tag=None, skip_same=False):
+    image = read_image(filename, mcu)
+    if image is None:
+        return
+    imgdata, imglen, loadcrc, imgtag = image
+    if tag is None:
+        tag = imgtag
+
+    bus = open_bus()
+
+    # check what the target already has
+    if skip_same and has_image(bus, boardid, imglen, loadcrc, tag):
+        print(f"board {boardid} already has this image, skipping load")
+        return
+
+    # load the image, then start the new app without waiting for the
+    # activity timeout
+    bl = BoardLoad(bus, boardid, imgdata, loadcrc, tag)
+    run_loads(bus, [bl])
+    if bl.result != "OK":
+        print(bl.result)
+        return
+
+    print("Load complete with success indication from target, app is starting")
+    print(f"len={imglen:04X} crc={loadcrc:04X}, {bl.retries} retries "
+          f"in {bl.elapsed:.1f} s")
+
+# load state of one board
+# Each board gets one message at a time and its REPORT is checked before the
+# next one is sent. The boards are independent, so while one board is busy
+# writing a flash page, the others can use the bus.
+#
+# A lost message or REPORT does not end the load. When a REPORT is late, a
+# PING is sent to the target and the receive counter in the PONG shows if the
+# target counted the pending message. A lost message is sent again, and a DATA
+# that was counted is not. The counter also filters out late REPORTs that
+# were already accounted for. The REPORT timeout follows the measured round
+# trip time, the same way as TCP (RFC 6298).
+class BoardLoad:
+    # time to wait for the STOP and RUN reports, the target checks or copies
+    # the image before it replies
+    TIMEOUT = {"stop": 3.0, "run": 1.0}
+    # initial value and limits of the adaptive REPORT timeout
+    RTO_INIT = 0.1
+    RTO_MIN = 0.02
+    RTO_MAX = 1.0
+    # late REPORTs in a row before the load is given up
+    MAX_RETRIES = 5
+    # REPORTs with a receive counter this far ahead of the last one are new
+    COUNT_WINDOW = 16
+
+    # if discard, then STOP has a wrong CRC so the target does not keep the
+    # image, and the app is not started. This is used by bench.
+    def __init__(self, canbus, boardid, imgdata, loadcrc, tag, discard=False):
+        self.bus = canbus
+        self.boardid = boardid
+        self.imgdata = imgdata
+        self.loadcrc = loadcrc
+        self.tag = tag
+        self.discard = discard
+        self.idx = 0
+        self.state = "sync"
+        self.result = None
+        self.deadline = 0
+        self.starttime = 0
+        self.elapsed = None
+        self.pending = None     # (cmdid, data) of the message being answered
+        self.sendtime = 0
+        self.rxcount = None     # target receive counter in the last REPORT
+        self.probes = 0         # PINGs sent since the pending message
+        self.resent = False     # no round trip sample from a resent message
+        self.retries = 0        # late REPORTs in the whole load
+        self.tries = 0          # late REPORTs since the last good one
+        self.srtt = None
+        self.rttvar = 0
+        self.rto = self.RTO_INIT
+        self.frames = 0         # messages sent and REPORTs received
+        self.data_rtts = []     # (end of DATA, round trip time)
+
+    def done(self):
+        return self.result is not None
+
+    def transmit(self, cmdid, data, timeout):
+        arbid = build_arbid(boardid=self.boardid, cmdid=cmdid)
+        msg = can.Message(arbitration_id=arbid, is_extended_id=True, data=data)
+        self.bus.send(msg)
+        self.frames += 1
+        self.deadline = time.monotonic() + timeout
+
+    # send the next message of the load
+    def send(self, cmdid, data, resend=False):
+        self.pending = (cmdid, data)
+        self.resent = resend
+        self.sendtime = time.monotonic()
+        self.transmit(cmdid, data, self.TIMEOUT.get(self.state, self.rto))
+
+    # ask the target for its receive counter
+    def probe(self):
+        self.probes += 1
+        self.resent = True
+        self.transmit(0, [], self.rto)  # PING
+
+    # update the REPORT timeout with a new round trip sample
+    def sample_rtt(self, rtt):
+        if self.srtt is None:
+            self.srtt = rtt
+            self.rttvar = rtt / 2
+        else:
+            self.rttvar = 0.75 * self.rttvar + 0.25 * abs(self.srtt - rtt)
+            self.srtt = 0.875 * self.srtt + 0.125 * rtt
+        self.rto = min(max(self.srtt + 4 * self.rttvar, self.RTO_MIN), self.RTO_MAX)
+
+    def finish(self, result):
+        self.result = result
+        self.elapsed = time.monotonic() - self.starttime
+
+    def fail(self, why, rpt=None):
+        self.finish(f"ERR: {why}" + (f" (report: {list(rpt)})" if rpt else ""))
+
+    # send the first message of the load, a PING to get the receive counter
+    def begin(self):
+        self.starttime = time.monotonic()
+        self.send(0, [])  # PING
+
+    # send the next DATA, or STOP after the last one
+    def next_data(self):
+        if self.idx < len(self.imgdata):
+            self.state = "data"
+            self.send(3, self.imgdata[self.idx:self.idx + 8])  # DATA
+            self.idx += 8
+        else:
+            self.state = "stop"
+            stopcrc = self.loadcrc ^ 0xFFFF if self.discard else self.loadcrc
+            stopdata = [stopcrc & 0xFF, (stopcrc >> 8) & 0xFF]
+            if self.tag is not None:
+                stopdata += [self.tag & 0xFF, (self.tag >> 8) & 0xFF]
+            self.send(4, stopdata)  # STOP
+
+    # handle a REPORT from this board
+    def report(self, rpt):
+        self.frames += 1
+        count = rpt[7]
+        if self.rxcount is not None:
+            if not 0 < ((count - self.rxcount) & 0xFF) <= self.COUNT_WINDOW:
+                return  # late REPORT to a message that is accounted for
+
+            # the PONG to a probe. It can also come after the REPORT it was
+            # waiting for, and then only the counter is kept.
+            if rpt[4] == 0:
+                if self.probes:
+                    self.probed(count)
+                else:
+                    self.rxcount = count
+                return
+
+        self.rxcount = count
+        self.probes = 0
+        self.tries = 0
+        if not self.resent and self.state in ("sync", "start", "data"):
+            rtt = time.monotonic() - self.sendtime
+            self.sample_rtt(rtt)
+            if self.state == "data":
+                self.data_rtts.append((self.idx, rtt))
+        self.answered(rpt)
+
+    # the PONG to a probe shows if the pending message was counted
+    # If an earlier probe was lost too, it may not be clear. Then a DATA is
+    # not sent again and the load fails, the other messages can be sent again
+    # anyway.
+    def probed(self, count):
+        counted = ((count - self.rxcount) & 0xFF) - 1
+        probes = self.probes
+        self.rxcount = count
+        self.probes = 0
+        if counted == 0 or self.state != "data":
+            # the message was lost, or it can be sent again
+            self.send(*self.pending, resend=True)
+        elif counted == probes:
+            # the DATA was counted and only the REPORT was lost
+            self.next_data()
+        else:
+            self.fail(f"DATA may be lost, target counted {counted} of "
+                      f"{probes} messages")
+
+    # check the REPORT to the pending message, and send the next one
+    def answered(self, rpt):
+        imglen = len(self.imgdata)
+        if self.state == "sync":
+            if rpt[4] != 0:
+                self.fail("unexpected report to PING", rpt)
+            else:
+                self.state = "start"
+                self.send(2, [imglen & 0xFF, (imglen >> 8) & 0xFF])  # START
+
+        elif self.state in ("start", "data"):
+            # READY after START or DATA, END after the last DATA
+            expected = 2 if self.state == "data" and self.idx == imglen else 1
+            if rpt[4] != expected:
+                self.fail(f"unexpected report after {self.state.upper()}", rpt)
+            else:
+                self.next_data()
+
+        elif self.state == "stop":
+            if self.discard:
+                if rpt[4] != 3 or rpt[5] != 0:
+                    self.fail("target did not discard the load", rpt)
+                else:
+                    self.finish("OK")
+            elif rpt[4] != 3 or rpt[5] != 1:
+                self.fail("load error after STOP", rpt)
+            else:
+                self.state = "run"
+                self.send(1, [])  # RUN
+
+        elif self.state == "run":
+            if rpt[4] == 5 and rpt[5] == 1:
+                # ERR to RUN, a small build starts the app at the boot timeout
+                self.finish("OK")
+            elif rpt[4] != 4 or rpt[5] != 1:
+                self.fail("app did not start", rpt)
+            else:
+                self.finish("OK")
+
+    # check for a late REPORT
+    def check_timeout(self, now):
+        if self.done() or now <= self.deadline:
+            return
+        if self.tries == self.MAX_RETRIES:
+            self.fail(f"no report after {self.state.upper()}")
             return
 
-    # send STOP command
-    arbid = build_arbid(boardid=boardid, cmdid=4)
-    msg = can.Message(arbitration_id=arbid, is_extended_id=True,
-            data=[loadcrc & 0xFF, (loadcrc >> 8) & 0xFF])
-    bus.send(msg)
-    rpt = get_report(bus)
-    if rpt is None or rpt[4] != 3:
-        print("ERR: did not recieve DONE after STOP")
-        print("report:", rpt)
+        self.retries += 1
+        self.tries += 1
+        self.rto = min(self.rto * 2, self.RTO_MAX)
+        if self.rxcount is None:
+            self.send(*self.pending, resend=True)   # PING again
+        else:
+            self.probe()
+
+# upload the hex file filename to several boards at once, on one bus
+# the DATA messages to the boards are interleaved, and the REPORTs are
+# matched to the boards by the board ID in the CAN ID
+def load_multi(boardids, filename, mcu, tag=None, skip_same=False):
+    image = read_image(filename, mcu)
+    if image is None:
         return
+    imgdata, imglen, loadcrc, imgtag = image
+    if tag is None:
+        tag = imgtag
 
-    if rpt[5] != 1:
-        print("ERR: target indicates load error")
+    bus = open_bus(reports_only=True)
+
+    if skip_same:
+        same = [b for b in boardids if has_image(bus, b, imglen, loadcrc, tag)]
+        for boardid in same:
+            print(f"board {boardid} already has this image, skipping load")
+        boardids = [b for b in boardids if b not in same]
+
+    loads = [BoardLoad(bus, b, imgdata, loadcrc, tag) for b in boardids]
+    starttime = time.monotonic()
+    run_loads(bus, loads)
+
+    elapsed = time.monotonic() - starttime
+    print(f"len={imglen:04X} crc={loadcrc:04X}, {len(loads)} boards "
+          f"in {elapsed:.1f} s")
+    for bl in sorted(loads, key=lambda bl: bl.boardid):
+        retries = f" ({bl.retries} retries)" if bl.retries else ""
+        print(f"board {bl.boardid:02d}: {bl.result}{retries}")
+
+# run a set of board loads on one bus until they are all done
+def run_loads(canbus, loads):
+    byid = {bl.boardid: bl for bl in loads}
+    for bl in loads:
+        bl.begin()
+
+    while not all(bl.done() for bl in loads):
+        rxmsg = canbus.recv(timeout=0.01)
+        if rxmsg is not None and rxmsg.dlc == 8 \
+                and (rxmsg.arbitration_id & 0x0F) == 5:  # REPORT
+            bl = byid.get((rxmsg.arbitration_id >> 4) & 0x0F)
+            if bl is not None and not bl.done():
+                bl.report(rxmsg.data)
+        now = time.monotonic()
+        for bl in loads:
+            bl.check_timeout(now)
+
+# image patterns for bench
+BENCH_PATTERNS = ("ramp", "zero", "erased", "random")
+
+# make a test image of size bytes, rounded up to a multiple of 8
+# the random pattern always has the same seed, so runs can be compared. The
+# first word of each flash page is the run number, so no page of a run has
+# the same data as the run before.
+# returns tuple (imgdata, loadcrc)
+def bench_image(size, pattern, run_num, pagesize):
+    size = (size + 7) & ~7
+    if pattern == "zero":
+        imgdata = bytearray(size)
+    elif pattern == "erased":
+        imgdata = bytearray(b"\xFF" * size)
+    elif pattern == "random":
+        imgdata = bytearray(random.Random(size).randbytes(size))
+    else:
+        imgdata = bytearray(i & 0xFF for i in range(size))
+    for addr in range(0, size, pagesize):
+        struct.pack_into("<H", imgdata, addr, run_num)
+    imgdata = bytes(imgdata)
+    loadcrc = 0
+    for val in imgdata:
+        loadcrc = crc16_update(loadcrc, val)
+    return imgdata, loadcrc
+
+# nearest-rank percentile of a list of values
+def percentile(vals, pct):
+    vals = sorted(vals)
+    return vals[max(0, -(-len(vals) * pct // 100) - 1)]
+
+# time loads of a test image to boardid, and show where the time goes
+# The target does not keep the image (see BoardLoad discard), but its app is
+# overwritten unless it has dual slots, so that needs overwrite_app. A DATA
+# that ends a flash page of the mcu waits for the page write, the others only
+# for the CAN frames.
+def bench(boardid, size, pattern, repeat, mcu, overwrite_app=False):
+    if not DUAL_SLOT[mcu] and _transport != "loopback":
+        if not overwrite_app:
+            print(f"bench overwrites the app of an {mcu} target, "
+                  "use --overwrite-app to run it anyway")
+            return
+        print(f"warning: the app of board {boardid} is overwritten, "
+              "load it again after the bench")
+    pagesize = FLASH_PAGE[mcu]
+    imgdata, loadcrc = bench_image(size, pattern, 0, pagesize)
+    imglen = len(imgdata)
+    bus = open_bus(reports_only=True)
+
+    print(f"image:      {imglen} bytes {pattern}, {-(-imglen // pagesize)} pages "
+          f"of {pagesize}, {_transport} at {_can_rate} bit/s")
+    runs = []
+    for run_num in range(1, repeat + 1):
+        imgdata, loadcrc = bench_image(size, pattern, run_num, pagesize)
+        bl = BoardLoad(bus, boardid, imgdata, loadcrc, None, discard=True)
+        run_loads(bus, [bl])
+        if bl.result != "OK":
+            print(f"run {run_num}:      {bl.result}")
+            return
+        print(f"run {run_num}:      {bl.elapsed:.3f} s, {bl.retries} retries")
+        runs.append(bl)
+
+    times = [bl.elapsed for bl in runs]
+    total = sum(times)
+    frames = sum(bl.frames for bl in runs)
+    page_rtts = []
+    data_rtts = []
+    for bl in runs:
+        for end, rtt in bl.data_rtts:
+            if end % pagesize == 0 or end == imglen:
+                page_rtts.append(rtt * 1000)
+            else:
+                data_rtts.append(rtt * 1000)
+
+    print(f"time:       min {min(times):.3f}  p50 {percentile(times, 50):.3f}  "
+          f"max {max(times):.3f} s")
+    print(f"throughput: {imglen * repeat / total:.0f} bytes/s, "
+          f"{frames / total:.0f} frames/s")
+    for name, rtts in (("DATA rtt", data_rtts), ("page rtt", page_rtts)):
+        if rtts:
+            print(f"{name + ':':11} p50 {percentile(rtts, 50):.2f}  "
+                  f"p90 {percentile(rtts, 90):.2f}  p99 {percentile(rtts, 99):.2f}  "
+                  f"max {max(rtts):.2f} ms, {len(rtts)} frames")
+    if data_rtts and page_rtts:
+        extra = percentile(page_rtts, 50) - percentile(data_rtts, 50)
+        print(f"page extra: {extra:.2f} ms")
+
+# round trip time histogram buckets of analyze, upper limits in ms
+TRACE_BUCKETS = (1, 2, 5, 10, 20, 50, 100, 1000)
+
+# load sessions of one board in a trace, see analyze
+class TraceSession:
+    def __init__(self, channel, boardid):
+        self.channel = channel
+        self.boardid = boardid
+        self.first = None
+        self.last = 0
+        self.loads = 0
+        self.loadlen = 0
+        self.offset = 0         # end of the last DATA
+        self.pending = None     # (time, cmdid, data) of the last command
+        self.answered = False   # there was a REPORT to the last command
+        self.replied = 0        # time of the last REPORT
+        self.data_rtts = []
+        self.page_rtts = []
+        self.gaps = []          # host time from a REPORT to the next command
+        self.probes = 0
+        self.resent = 0
+        self.lost = 0
+        self.result = None
+
+    def command(self, stamp, cmdid, data):
+        if self.first is None:
+            self.first = stamp
+        self.last = stamp
+        resend = False
+        if self.pending is not None and not self.answered:
+            # no REPORT to the last command
+            if cmdid == 0:
+                self.probes += 1
+                return
+            resend = (cmdid, data) == self.pending[1:]
+            if resend:
+                self.resent += 1
+            else:
+                self.lost += 1
+        elif self.answered:
+            self.gaps.append(stamp - self.replied)
+
+        if cmdid == 2 and not resend:    # START
+            self.loads += 1
+            self.loadlen = data[0] + (data[1] << 8)
+            self.offset = 0
+        elif cmdid == 3 and not resend:  # DATA
+            self.offset += 8
+        self.pending = (stamp, cmdid, data)
+        self.answered = False
+
+    def report(self, stamp, data, pagesize):
+        self.last = stamp
+        if self.pending is None or self.answered:
+            return  # late REPORT, or not to a command in the trace
+        sent, cmdid, _ = self.pending
+        if data[4] == 0 and cmdid != 0:
+            return  # PONG to a probe
+        self.answered = True
+        self.replied = stamp
+        rtt = stamp - sent
+        if cmdid == 3 and data[4] in (1, 2):
+            if self.offset % pagesize == 0 or self.offset >= self.loadlen:
+                self.page_rtts.append(rtt)
+            else:
+                self.data_rtts.append(rtt)
+        elif cmdid == 4 and data[4] == 3:
+            self.result = "DONE ok" if data[5] == 1 else "DONE error"
+        elif cmdid == 1 and data[4] == 4:
+            self.result = "RUN ok" if data[5] == 1 else "RUN app not valid"
+
+# print one line of round trip or gap times in ms
+def print_times(name, times):
+    if not times:
         return
+    ms = [t * 1000 for t in times]
+    print(f"  {name + ':':12} p50 {percentile(ms, 50):.2f}  p90 {percentile(ms, 90):.2f}  "
+          f"max {max(ms):.2f} ms, total {sum(times):.3f} s, {len(ms)} frames")
+
+# reconstruct the load sessions in a trace file, see --trace
+# This shows how much time each board spent waiting for the target (the
+# round trips) and for the host (the gaps between a REPORT and the next
+# command), the flash page commits, retries and a round trip histogram.
+def analyze(filename, mcu):
+    pagesize = FLASH_PAGE[mcu]
+    sessions = {}
+    for stamp, channel, arbid, data in read_trace(filename):
+        boardid = (arbid >> 4) & 0x0F
+        cmdid = arbid & 0x0F
+        if arbid != build_arbid(boardid, cmdid):
+            continue    # not a boot loader message
+        key = (channel, boardid)
+        if key not in sessions:
+            sessions[key] = TraceSession(channel, boardid)
+        if cmdid == 5:
+            if len(data) == 8:
+                sessions[key].report(stamp, data, pagesize)
+        else:
+            sessions[key].command(stamp, cmdid, data)
+
+    for key in sorted(sessions):
+        ts = sessions[key]
+        if ts.first is None:
+            continue
+        rtts = ts.data_rtts + ts.page_rtts
+        print(f"{ts.channel} board {ts.boardid}: {ts.loads} loads of {ts.loadlen} bytes, "
+              f"{ts.last - ts.first:.3f} s, last {ts.result or 'no DONE'}")
+        print_times("DATA rtt", ts.data_rtts)
+        print_times("page commit", ts.page_rtts)
+        print_times("host gap", ts.gaps)
+        print(f"  retries:     {ts.probes} probes, {ts.resent} resent, "
+              f"{ts.lost} REPORTs lost")
+        if rtts:
+            print(f"  target {sum(rtts):.3f} s, host {sum(ts.gaps):.3f} s")
+            low = 0
+            for high in TRACE_BUCKETS:
+                count = sum(1 for t in rtts if low <= t * 1000 < high)
+                print(f"  {low:4}-{high:<4} ms {count:6} {'#' * -(-40 * count // len(rtts))}")
+                low = high
+
+# read a rollout manifest
+# Each line is: interface board image [tag], and # starts a comment. The
+# board and tag can be decimal or 0x hex.
+# returns a list of dicts with the fields of each line
+def read_manifest(filename):
+    entries = []
+    with open(filename) as mf:
+        for lineno, line in enumerate(mf, 1):
+            fields = line.split("#", 1)[0].split()
+            if not fields:
+                continue
+            if len(fields) not in (3, 4):
+                raise ValueError(f"{filename}:{lineno}: expected interface board image [tag]")
+            entries.append({"interface": fields[0],
+                            "board": int(fields[1], 0),
+                            "image": fields[2],
+                            "tag": int(fields[3], 0) if len(fields) == 4 else None})
+    return entries
+
+# load the boards of a rollout that are on one CAN interface
+# all the boards on the interface are loaded at the same time, each with its
+# own image. Prints one JSON line per board when they are all done. An error
+# on the interface is the result of each board that was not done yet, and a
+# board whose image could not be read is not loaded and has the read error.
+def rollout_interface(interface, entries, images, skip_same, outlock):
+    results = {}    # board ID to (result, seconds, retries)
+    loads = []
+    error = "ERR: not loaded"
+    bus = None
+    try:
+        bus = open_bus(interface, reports_only=True)
+        for entry in entries:
+            image = images[entry["image"]]
+            if isinstance(image, str):
+                results[entry["board"]] = (image, 0.0, 0)
+                continue
+            imgdata, imglen, loadcrc, imgtag = image
+            tag = imgtag if entry["tag"] is None else entry["tag"]
+            if skip_same and has_image(bus, entry["board"], imglen, loadcrc, tag):
+                results[entry["board"]] = ("SKIP", 0.0, 0)
+            else:
+                loads.append(BoardLoad(bus, entry["board"], imgdata, loadcrc, tag))
+        run_loads(bus, loads)
+    except Exception as err:    # the worker has to report every board
+        error = f"ERR: {err}"
+    finally:
+        if bus is not None:
+            try:
+                bus.shutdown()
+            except (OSError, can.CanError):
+                pass
 
-    print("Load complete with success indication from target")
-    print(f"len={imglen:04X} crc={loadcrc:04X}")
+    for bl in loads:
+        if bl.done():
+            results[bl.boardid] = (bl.result, bl.elapsed, bl.retries)
+
+    with outlock:
+        for entry in entries:
+            result, elapsed, retries = results.get(entry["board"], (error, 0.0, 0))
+            print(json.dumps({"interface": interface, "board": entry["board"],
+                              "image": entry["image"], "result": result,
+                              "seconds": round(elapsed, 3), "retries": retries}))
+        sys.stdout.flush()
+
+# update a fleet of boards from a manifest, one worker thread per interface
+# the results are printed as JSON lines, one per board
+def rollout(manifest, mcu, skip_same=False):
+    entries = read_manifest(manifest)
+
+    # each image is only read once, an image that cannot be read is the
+    # error result of the boards it is for
+    images = {}
+    for entry in entries:
+        if entry["image"] not in images:
+            try:
+                image = read_image(entry["image"], mcu)
+            except Exception as err:    # OSError, or a bad hex file
+                image = f"ERR: {err}"
+            images[entry["image"]] = "ERR: bad image" if image is None else image
+
+    byiface = {}
+    for entry in entries:
+        byiface.setdefault(entry["interface"], []).append(entry)
+    for interface, ifentries in byiface.items():
+        boards = [e["board"] for e in ifentries]
+        if len(set(boards)) != len(boards):
+            print(f"ERR: board listed twice on {interface}", file=sys.stderr)
+            return False
+
+    outlock = threading.Lock()
+    workers = [threading.Thread(target=rollout_interface,
+                                args=(iface, ifentries, images, skip_same, outlock))
+               for iface, ifentries in byiface.items()]
+    for worker in workers:
+        worker.start()
+    for worker in workers:
+        worker.join()
+    return True
 
 # command line interface
 def cli():
     global _can_rate
+    global _can_channel
+    global _transport
+    global _trace
+    global _id_base
 
     parser = argparse.ArgumentParser(description="CAN Firmware Loader")
     parser.add_argument('-v', "--verbose", action="store_true",
                         help="turn on some debug output")
     parser.add_argument('-r', "--rate", type=int, default=_can_rate,
                         help=f"CAN data rate ({_can_rate})")
-    parser.add_argument('-f', "--file", help="file to upload")
-    parser.add_argument('-b', "--board", type=int, help="board ID of target")
-    parser.add_argument("command", help="loader command (ping, scan, load)")
+    parser.add_argument('-c', "--channel", default=_can_channel,
+                        help=f"CAN interface ({_can_channel})")
+    parser.add_argument("--transport", choices=TRANSPORTS, default=_transport,
+                        help=f"CAN transport ({_transport})")
+    parser.add_argument("--trace",
+                        help="record all CAN messages to this file (candump log)")
+    parser.add_argument('-f', "--file",
+                        help="hex file or bundle to upload, or rollout manifest")
+    parser.add_argument('-o', "--output",
+                        help="bundle file written by pack (file name with .cbb)")
+    parser.add_argument('-b', "--board", type=lambda x: [int(b, 0) for b in x.split(",")],
+                        help="board ID of target, load can take a list (0,1,...)")
+    parser.add_argument('-t', "--tag", type=lambda x: int(x, 0),
+                        help="16-bit version tag to store with loaded image")
+    parser.add_argument("--skip-same", action="store_true",
+                        help="skip load if target already has the image")
+    parser.add_argument("--id-base", type=lambda x: int(x, 0),
+                        default=_id_base,
+                        help=f"CAN ID base of the boot loader ({_id_base:08X})")
+    parser.add_argument("--id-mask", type=lambda x: int(x, 0),
+                        default=ID_MASK_DEFAULT,
+                        help=f"CAN ID filter mask for idconfig ({ID_MASK_DEFAULT:08X})")
+    parser.add_argument("--mcu", choices=EEPROM_END.keys(), default="atmega16m1",
+                        help="target MCU for idconfig, pack, bench, analyze and bundle loads (atmega16m1)")
+    parser.add_argument("--clear", action="store_true",
+                        help="clear the counters after stats")
+    parser.add_argument("--size", type=lambda x: int(x, 0), default=4096,
+                        help="test image size for bench (4096)")
+    parser.add_argument("--pattern", choices=BENCH_PATTERNS, default="ramp",
+                        help="test image pattern for bench (ramp)")
+    parser.add_argument("--repeat", type=int, default=3,
+                        help="number of loads for bench (3)")
+    parser.add_argument("--overwrite-app", action="store_true",
+                        help="let bench overwrite the app of a target without dual slots")
+    parser.add_argument("command", help="loader command (ping, scan, listen, load, run, enter, stats, idconfig, rollout, pack, bench, analyze)")
 
     args = parser.parse_args()
 
     if args.rate:
         _can_rate = args.rate
+    _id_base = args.id_base
+    _can_channel = args.channel
+    _transport = args.transport
+    if args.trace:
+        _trace = open(args.trace, "w")
+
+    # only load can take a list of boards
+    boards = args.board
+    if boards is not None and len(boards) > 1 and args.command != "load":
+        print(f"{args.command} takes only one --board")
+        return
+    board = boards[0] if boards else None
 
     if args.command == "scan":
         scan()
 
+    elif args.command == "listen":
+        listen()
+
     elif args.command == "ping":
-        if args.board is None:
+        if board is None:
             print("ping must specify --board")
         else:
-            ping(args.board)
+            ping(board)
 
     elif args.command == "load":
-        if args.board is None:
+        if board is None:
             print("load must specify --board")
         elif args.file is None:
             print("load must specify --file")
+        elif len(boards) > 1:
+            load_multi(boards, args.file, args.mcu, tag=args.tag,
+                       skip_same=args.skip_same)
+        else:
+            load(board, args.file, args.mcu, tag=args.tag, skip_same=args.skip_same)
+
+    elif args.command == "run":
+        if board is None:
+            print("run must specify --board")
         else:
-            load(args.board, args.file)
+            run(board)
+
+    elif args.command == "enter":
+        if board is None:
+            print("enter must specify --board")
+        else:
+            enter(board)
+
+    elif args.command == "stats":
+        if board is None:
+            print("stats must specify --board")
+        else:
+            stats(board, clear=args.clear)
+
+    elif args.command == "analyze":
+        if args.file is None:
+            print("analyze must specify --file for the trace")
+        else:
+            analyze(args.file, args.mcu)
+
+    elif args.command == "bench":
+        if board is None:
+            print("bench must specify --board")
+        else:
+            bench(board, args.size, args.pattern, args.repeat, args.mcu,
+                  args.overwrite_app)
+
+    elif args.command == "rollout":
+        if args.file is None:
+            print("rollout must specify --file for the manifest")
+        else:
+            rollout(args.file, args.mcu, skip_same=args.skip_same)
+
+    elif args.command == "pack":
+        if args.file is None:
+            print("pack must specify --file for the hex file")
+        else:
+            outname = args.output or os.path.splitext(args.file)[0] + ".cbb"
+            pack(args.file, outname, args.mcu, tag=args.tag)
+
+    elif args.command == "idconfig":
+        if args.file is None:
+            print("idconfig must specify --file for the EEPROM hex file")
+        else:
+            idconfig(args.file, args.mcu, args.id_base, args.id_mask)
 
     else:
         print("unknown command")
 
+    if _trace is not None:
+        _trace.close()
+
 if __name__ == "__main__":
     cli()